@@ -0,0 +1,354 @@
+#pragma once
+
+#include "entity.h"
+#include "grid.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary frame layout, all integers little-endian:
+//
+//   offset  size  field
+//        0     4  magic "ECOF"
+//        4     1  version
+//        5     1  encoding of the payload
+//        6     2  reserved, zero
+//        8     4  width
+//       12     4  height
+//       16     8  step
+//       24     8  generation
+//       32        payload
+//
+// Payload encodings:
+//  - packed (0) is planar: the types at 2 bits per cell (cell k in bits 2 * (k % 4) of byte k / 4, with the
+//    values of entity_type_t), then one byte of age per cell, then one byte of energy per cell.
+//  - run-length (1) lists the cells that are not blank ({empty, 0, 0}) in row-major order, each as the number
+//    of blank cells before it (LEB128 varint) followed by its type, age and energy bytes. Cells after the
+//    last record are blank.
+//  - sparse (2) is a uint32 record count followed by one record per non-blank cell: uint16 row, uint16 column,
+//    then type, age and energy bytes.
+// Ages and energies are clamped to [0, 255]; no rule lets them leave that range.
+// encode_binary_frame picks whichever encoding makes the frame smallest, so sparse worlds cost bytes
+// in proportion to their population rather than their area.
+const uint8_t BINARY_FRAME_VERSION = 1;
+const size_t BINARY_FRAME_HEADER_SIZE = 32;
+
+enum binary_frame_encoding_t : uint8_t
+{
+    packed_encoding = 0,
+    run_length_encoding = 1,
+    sparse_encoding = 2
+};
+
+// Bytes per record of the run-length encoding (after the varint) and of the sparse encoding
+const size_t RUN_LENGTH_CELL_SIZE = 3;
+const size_t SPARSE_RECORD_SIZE = 7;
+
+inline void put_le(std::string &out, uint64_t value, size_t bytes)
+{
+    for (size_t k = 0; k < bytes; k++)
+    {
+        out.push_back((char)(value >> (8 * k)));
+    }
+}
+
+inline void write_binary_frame_header(std::string &out, binary_frame_encoding_t encoding, uint32_t width,
+                                      uint32_t height, uint64_t step, uint64_t generation)
+{
+    out.append("ECOF", 4);
+    put_le(out, BINARY_FRAME_VERSION, 1);
+    put_le(out, encoding, 1);
+    put_le(out, 0, 2);
+    put_le(out, width, 4);
+    put_le(out, height, 4);
+    put_le(out, step, 8);
+    put_le(out, generation, 8);
+}
+
+inline uint8_t saturate_byte(int32_t value)
+{
+    return (uint8_t)std::min(255, std::max(0, value));
+}
+
+inline bool is_blank(const entity_t &cell)
+{
+    return cell.type == empty && cell.age == 0 && cell.energy == 0;
+}
+
+inline size_t varint_size(uint64_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+inline void put_varint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+inline void put_cell(std::string &out, const entity_t &cell)
+{
+    out.push_back((char)(cell.type & 3));
+    out.push_back((char)saturate_byte(cell.age));
+    out.push_back((char)saturate_byte(cell.energy));
+}
+
+// Payload size of each encoding for a grid, measured in one pass
+struct payload_sizes_t
+{
+    size_t packed = 0;
+    size_t run_length = 0;
+    size_t sparse = 0;
+};
+
+inline payload_sizes_t measure_payloads(const grid_t<entity_t> &grid)
+{
+    payload_sizes_t sizes;
+    sizes.packed = (grid.size() + 3) / 4 + 2 * grid.size();
+    uint64_t occupied = 0;
+    uint64_t gap = 0;
+    for (const entity_t &cell : grid)
+    {
+        if (is_blank(cell))
+        {
+            gap++;
+            continue;
+        }
+        sizes.run_length += varint_size(gap) + RUN_LENGTH_CELL_SIZE;
+        occupied++;
+        gap = 0;
+    }
+    sizes.sparse = 4 + occupied * SPARSE_RECORD_SIZE;
+    return sizes;
+}
+
+// Size of the binary frame of a grid of num_cells cells of which occupied are not blank, estimated without
+// reading the grid: exact for the packed and sparse encodings, and assuming evenly spaced cells for run-length
+inline size_t estimate_binary_frame_size(size_t num_cells, uint64_t occupied)
+{
+    const size_t packed = (num_cells + 3) / 4 + 2 * num_cells;
+    const size_t run_length = occupied * (RUN_LENGTH_CELL_SIZE + varint_size(occupied == 0 ? 0 : num_cells / occupied));
+    const size_t sparse = 4 + occupied * SPARSE_RECORD_SIZE;
+    return BINARY_FRAME_HEADER_SIZE + std::min(packed, std::min(run_length, sparse));
+}
+
+inline void write_packed_payload(std::string &out, const grid_t<entity_t> &grid)
+{
+    const size_t n = grid.size();
+    const size_t types_size = (n + 3) / 4;
+    const size_t payload = out.size();
+    out.resize(payload + types_size + 2 * n, 0);
+    char *types = &out[payload];
+    char *ages = types + types_size;
+    char *energies = ages + n;
+    for (size_t idx = 0; idx < n; idx++)
+    {
+        const entity_t &cell = grid[idx];
+        types[idx / 4] |= (char)((cell.type & 3) << (2 * (idx % 4)));
+        ages[idx] = (char)saturate_byte(cell.age);
+        energies[idx] = (char)saturate_byte(cell.energy);
+    }
+}
+
+inline void write_run_length_payload(std::string &out, const grid_t<entity_t> &grid)
+{
+    uint64_t gap = 0;
+    for (const entity_t &cell : grid)
+    {
+        if (is_blank(cell))
+        {
+            gap++;
+            continue;
+        }
+        put_varint(out, gap);
+        put_cell(out, cell);
+        gap = 0;
+    }
+}
+
+inline void write_sparse_payload(std::string &out, const grid_t<entity_t> &grid)
+{
+    const size_t count_offset = out.size();
+    put_le(out, 0, 4);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < grid.height(); i++)
+    {
+        for (uint32_t j = 0; j < grid.width(); j++)
+        {
+            const entity_t &cell = grid(i, j);
+            if (is_blank(cell))
+            {
+                continue;
+            }
+            put_le(out, i, 2);
+            put_le(out, j, 2);
+            put_cell(out, cell);
+            count++;
+        }
+    }
+    for (size_t k = 0; k < 4; k++)
+    {
+        out[count_offset + k] = (char)(count >> (8 * k));
+    }
+}
+
+inline std::string encode_binary_frame(const grid_t<entity_t> &grid, uint64_t step, uint64_t generation,
+                                       binary_frame_encoding_t encoding)
+{
+    std::string out;
+    write_binary_frame_header(out, encoding, grid.width(), grid.height(), step, generation);
+    switch (encoding)
+    {
+    case run_length_encoding:
+        write_run_length_payload(out, grid);
+        break;
+    case sparse_encoding:
+        write_sparse_payload(out, grid);
+        break;
+    default:
+        write_packed_payload(out, grid);
+        break;
+    }
+    return out;
+}
+
+// Encoding that gives the smallest frame for the grid
+inline binary_frame_encoding_t choose_encoding(const grid_t<entity_t> &grid)
+{
+    payload_sizes_t sizes = measure_payloads(grid);
+    binary_frame_encoding_t encoding = packed_encoding;
+    size_t smallest = sizes.packed;
+    if (sizes.run_length < smallest)
+    {
+        encoding = run_length_encoding;
+        smallest = sizes.run_length;
+    }
+    if (sizes.sparse < smallest)
+    {
+        encoding = sparse_encoding;
+    }
+    return encoding;
+}
+
+inline std::string encode_binary_frame(const grid_t<entity_t> &grid, uint64_t step, uint64_t generation)
+{
+    return encode_binary_frame(grid, step, generation, choose_encoding(grid));
+}
+
+inline uint64_t get_le(const char *in, size_t bytes)
+{
+    uint64_t value = 0;
+    for (size_t k = 0; k < bytes; k++)
+    {
+        value |= (uint64_t)(uint8_t)in[k] << (8 * k);
+    }
+    return value;
+}
+
+// Read a varint at in[offset], advancing offset. Returns false if it runs past size.
+inline bool get_varint(const char *in, size_t size, size_t &offset, uint64_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; offset < size && shift < 64; shift += 7)
+    {
+        uint8_t byte = (uint8_t)in[offset++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline entity_t get_cell(const char *in)
+{
+    return {(entity_type_t)(in[0] & 3), (uint8_t)in[2], (uint8_t)in[1]};
+}
+
+// Decode a frame written by encode_binary_frame into grid. Returns false if it is truncated or malformed.
+inline bool decode_binary_frame(const char *in, size_t size, grid_t<entity_t> &grid, uint64_t &step, uint64_t &generation)
+{
+    if (size < BINARY_FRAME_HEADER_SIZE || std::string(in, 4) != "ECOF" || (uint8_t)in[4] != BINARY_FRAME_VERSION)
+    {
+        return false;
+    }
+    const uint8_t encoding = (uint8_t)in[5];
+    const uint32_t width = (uint32_t)get_le(in + 8, 4);
+    const uint32_t height = (uint32_t)get_le(in + 12, 4);
+    step = get_le(in + 16, 8);
+    generation = get_le(in + 24, 8);
+    grid.assign(height, width, {empty, 0, 0});
+    const size_t n = grid.size();
+    size_t offset = BINARY_FRAME_HEADER_SIZE;
+
+    if (encoding == packed_encoding)
+    {
+        const size_t types_size = (n + 3) / 4;
+        if (size != offset + types_size + 2 * n)
+        {
+            return false;
+        }
+        const char *types = in + offset;
+        const char *ages = types + types_size;
+        const char *energies = ages + n;
+        for (size_t idx = 0; idx < n; idx++)
+        {
+            grid[idx] = {(entity_type_t)((types[idx / 4] >> (2 * (idx % 4))) & 3), (uint8_t)energies[idx], (uint8_t)ages[idx]};
+        }
+        return true;
+    }
+    if (encoding == run_length_encoding)
+    {
+        size_t idx = 0;
+        while (offset < size)
+        {
+            uint64_t gap;
+            if (!get_varint(in, size, offset, gap) || offset + RUN_LENGTH_CELL_SIZE > size || gap >= n - idx)
+            {
+                return false;
+            }
+            idx += gap;
+            grid[idx++] = get_cell(in + offset);
+            offset += RUN_LENGTH_CELL_SIZE;
+        }
+        return true;
+    }
+    if (encoding == sparse_encoding)
+    {
+        if (size < offset + 4)
+        {
+            return false;
+        }
+        const uint64_t count = get_le(in + offset, 4);
+        offset += 4;
+        if (size != offset + count * SPARSE_RECORD_SIZE)
+        {
+            return false;
+        }
+        for (uint64_t k = 0; k < count; k++, offset += SPARSE_RECORD_SIZE)
+        {
+            const uint32_t i = (uint32_t)get_le(in + offset, 2);
+            const uint32_t j = (uint32_t)get_le(in + offset + 2, 2);
+            if (i >= height || j >= width)
+            {
+                return false;
+            }
+            grid(i, j) = get_cell(in + offset + 4);
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include "entity.h"
+#include "file_name.h"
+#include "grid.h"
+#include "population_stats.h"
+#include "simulation.h"
+#include "tile_scheduler.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// Checkpoint file layout, integers in the byte order of the machine that wrote it:
+//
+//   offset  size  field
+//        0     8  magic "ECOCKPT\0"
+//        8     4  version
+//       12     4  byte-order mark 0x01020304, to refuse files written on a machine of the other endianness
+//       16     4  sizeof(entity_t)
+//       20     4  height
+//       24     4  width
+//       28     4  tile size
+//       32     8  step
+//       40     8  seed
+//       48     8  plants
+//       56     8  herbivores
+//       64     8  carnivores
+//       72     4  step mode (step_mode_t)
+//       76    52  reserved, zero
+//      128        height * width entity_t records, row-major, exactly as they are laid out in memory
+//
+// The parameters and the step counter are all the state a run has besides its grid (see cell_rng_t), so a
+// restored run goes on producing the same frames as the run that was saved. Because the cells are stored as
+// they are in memory, a checkpoint is loaded by mapping the file: the grid adopts the mapped cells instead of
+// decoding them into a buffer of its own. Every cell is still checked once while loading, since restoring reads
+// the whole grid anyway, and a page is only copied when the simulation first writes to it.
+const uint32_t CHECKPOINT_VERSION = 1;
+const uint32_t CHECKPOINT_BYTE_ORDER_MARK = 0x01020304;
+const char CHECKPOINT_EXTENSION[] = ".ckpt";
+
+struct checkpoint_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order_mark;
+    uint32_t entity_size;
+    uint32_t height;
+    uint32_t width;
+    uint32_t tile_size;
+    uint64_t step;
+    uint64_t seed;
+    uint64_t plants;
+    uint64_t herbivores;
+    uint64_t carnivores;
+    uint32_t mode;
+    uint8_t reserved[52];
+};
+static_assert(sizeof(checkpoint_header_t) == 128, "checkpoint header must be 128 bytes");
+
+// Whether a cell could have been produced by the simulation. Cells come off disk untrusted, and the
+// statistics, the step engines and the frame writers all index or size things by type, age and energy.
+inline bool valid_checkpoint_cell(const entity_t &cell)
+{
+    if (cell.type == empty)
+    {
+        return true;
+    }
+    if (cell.type != plant && cell.type != herbivore && cell.type != carnivore)
+    {
+        return false;
+    }
+    // Animals may end a step with up to a move's cost below zero and die on the next
+    return cell.age >= 0 && (uint32_t)cell.age <= SPECIES_MAXIMUM_AGE[cell.type - plant] &&
+           cell.energy >= -MOVE_ENERGY_COST && cell.energy <= (int32_t)MAXIMUM_ENERGY;
+}
+
+// Write the simulation to path. The file is written next to path and renamed over it once complete, so a
+// crash never leaves a truncated checkpoint behind. Returns an error message, or an empty string on success.
+inline std::string save_checkpoint(const std::string &path, const simulation_t &simulation)
+{
+    const simulation_params_t &params = simulation.params();
+    const grid_t<entity_t> &grid = simulation.grid();
+    checkpoint_header_t header = {};
+    std::memcpy(header.magic, "ECOCKPT", 8);
+    header.version = CHECKPOINT_VERSION;
+    header.byte_order_mark = CHECKPOINT_BYTE_ORDER_MARK;
+    header.entity_size = sizeof(entity_t);
+    header.height = grid.height();
+    header.width = grid.width();
+    header.tile_size = params.tile_size;
+    header.step = simulation.step_count();
+    header.seed = params.seed;
+    header.plants = params.plants;
+    header.herbivores = params.herbivores;
+    header.carnivores = params.carnivores;
+    header.mode = params.mode;
+
+    std::string temporary_path = path + ".tmp";
+    std::FILE *file = std::fopen(temporary_path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return "Cannot create checkpoint file";
+    }
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   std::fwrite(grid.data(), sizeof(entity_t), grid.size(), file) == grid.size();
+    written = std::fclose(file) == 0 && written;
+    if (!written || std::rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary_path.c_str());
+        return "Cannot write checkpoint file";
+    }
+    return "";
+}
+
+// Outcome of load_checkpoint
+enum checkpoint_status_t
+{
+    checkpoint_loaded,
+    checkpoint_unknown,      // there is no such file
+    checkpoint_invalid,      // not a checkpoint, or one holding a world the simulation cannot produce
+    checkpoint_incompatible, // written by a build with another entity layout or byte order
+    checkpoint_unmapped      // the file could not be mapped
+};
+
+inline const char *checkpoint_status_message(checkpoint_status_t status)
+{
+    switch (status)
+    {
+    case checkpoint_loaded:
+        return "";
+    case checkpoint_unknown:
+        return "Unknown checkpoint";
+    case checkpoint_incompatible:
+        return "Checkpoint written by an incompatible build";
+    case checkpoint_unmapped:
+        return "Cannot map checkpoint";
+    default:
+        return "Invalid checkpoint";
+    }
+}
+
+// Map the checkpoint at path, check its cells and hand them to grid. The mapping is private: the simulation
+// writes to its own copy of the pages it changes, never to the file.
+inline checkpoint_status_t load_checkpoint(const std::string &path, simulation_params_t &params, uint64_t &step, grid_t<entity_t> &grid)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return checkpoint_unknown;
+    }
+    struct stat status;
+    if (::fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(checkpoint_header_t))
+    {
+        ::close(fd);
+        return checkpoint_invalid;
+    }
+    const size_t length = (size_t)status.st_size;
+    void *mapped = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open on its own
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        return checkpoint_unmapped;
+    }
+    std::shared_ptr<void> mapping(mapped, [length](void *address) { ::munmap(address, length); });
+
+    checkpoint_header_t header;
+    std::memcpy(&header, mapped, sizeof(header));
+    if (std::memcmp(header.magic, "ECOCKPT", 8) != 0 || header.version != CHECKPOINT_VERSION)
+    {
+        return checkpoint_invalid;
+    }
+    if (header.byte_order_mark != CHECKPOINT_BYTE_ORDER_MARK || header.entity_size != sizeof(entity_t))
+    {
+        return checkpoint_incompatible;
+    }
+    if (header.height == 0 || header.width == 0 || header.height > MAXIMUM_GRID_SIDE || header.width > MAXIMUM_GRID_SIDE ||
+        header.tile_size < tile_schedule_t::MINIMUM_TILE_SIZE ||
+        (header.mode != in_place_step && header.mode != double_buffered_step) ||
+        length != sizeof(header) + (size_t)header.height * header.width * sizeof(entity_t))
+    {
+        return checkpoint_invalid;
+    }
+
+    const entity_t *cells = reinterpret_cast<const entity_t *>((const char *)mapped + sizeof(header));
+    if (!std::all_of(cells, cells + (size_t)header.height * header.width, valid_checkpoint_cell))
+    {
+        return checkpoint_invalid;
+    }
+
+    params.height = header.height;
+    params.width = header.width;
+    params.tile_size = header.tile_size;
+    params.seed = header.seed;
+    params.plants = header.plants;
+    params.herbivores = header.herbivores;
+    params.carnivores = header.carnivores;
+    params.mode = (step_mode_t)header.mode;
+    step = header.step;
+    grid.adopt(header.height, header.width, reinterpret_cast<entity_t *>((char *)mapped + sizeof(header)), std::move(mapping));
+    return checkpoint_loaded;
+}
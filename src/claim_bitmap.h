@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// One bit per cell marking the cells claimed during the current step.
+// Checking and claiming are O(1) and test_and_set is atomic, so workers can claim cells concurrently;
+// the whole bitmap is cleared in bulk between steps.
+class claim_bitmap_t
+{
+public:
+    // Size the bitmap for num_cells cells, all unclaimed
+    void resize(size_t num_cells)
+    {
+        num_cells_ = num_cells;
+        num_words_ = (num_cells + 63) / 64;
+        words_.reset(new std::atomic<uint64_t>[num_words_]);
+        clear();
+    }
+
+    void clear()
+    {
+        for (size_t w = 0; w < num_words_; w++)
+        {
+            words_[w].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    size_t size() const { return num_cells_; }
+    size_t memory_usage() const { return num_words_ * sizeof(uint64_t); }
+
+    bool test(size_t idx) const
+    {
+        return (words_[idx / 64].load(std::memory_order_relaxed) >> (idx % 64)) & 1;
+    }
+
+    // Claim idx and return whether it had already been claimed
+    bool test_and_set(size_t idx)
+    {
+        const uint64_t bit = uint64_t(1) << (idx % 64);
+        return words_[idx / 64].fetch_or(bit, std::memory_order_relaxed) & bit;
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+    size_t num_words_ = 0;
+    size_t num_cells_ = 0;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <cstdlib>
+#include <string>
+
+// Content-Encodings the server can apply to a response body
+enum content_encoding_t
+{
+    identity_encoding,
+    gzip_encoding,
+    deflate_encoding // zlib stream, which is what HTTP calls deflate
+};
+
+inline const char *encoding_name(content_encoding_t encoding)
+{
+    switch (encoding)
+    {
+    case gzip_encoding:
+        return "gzip";
+    case deflate_encoding:
+        return "deflate";
+    default:
+        return "identity";
+    }
+}
+
+// Encoding for an Accept-Encoding header: gzip if the client takes it, otherwise deflate, otherwise none.
+// Codings listed with q=0 are refused.
+inline content_encoding_t negotiate_encoding(const std::string &accept_encoding)
+{
+    bool gzip = false;
+    bool deflate = false;
+    size_t begin = 0;
+    while (begin < accept_encoding.size())
+    {
+        size_t end = accept_encoding.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = accept_encoding.size();
+        }
+        std::string coding = accept_encoding.substr(begin, end - begin);
+        begin = end + 1;
+
+        double q = 1;
+        size_t q_param = coding.find("q=");
+        if (q_param != std::string::npos)
+        {
+            q = std::strtod(coding.c_str() + q_param + 2, nullptr);
+        }
+        coding = coding.substr(0, coding.find(';'));
+        coding.erase(0, coding.find_first_not_of(" \t"));
+        coding.erase(coding.find_last_not_of(" \t") + 1);
+        if (q <= 0)
+        {
+            continue;
+        }
+        gzip |= coding == "gzip" || coding == "*";
+        deflate |= coding == "deflate";
+    }
+    return gzip ? gzip_encoding : deflate ? deflate_encoding : identity_encoding;
+}
+
+// Compress in with the given encoding and level (1 fastest, 9 smallest). Returns false if zlib fails.
+inline bool compress_body(const std::string &in, content_encoding_t encoding, int level, std::string &out)
+{
+    z_stream stream = {};
+    // 15 bits of window; adding 16 asks zlib for a gzip header and trailer instead of the zlib ones
+    int window_bits = encoding == gzip_encoding ? 15 + 16 : 15;
+    if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+    out.resize(deflateBound(&stream, in.size()));
+    stream.next_in = (Bytef *)in.data();
+    stream.avail_in = (uInt)in.size();
+    stream.next_out = (Bytef *)&out[0];
+    stream.avail_out = (uInt)out.size();
+    int status = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
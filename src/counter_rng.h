@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+
+// splitmix64 finaliser: a cheap bijective mix of all 64 bits
+inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Counter-based random numbers: draw number n of cell c at step s is a pure hash of (seed, s, c, n).
+// There is no shared generator state, so workers never contend and a run is reproducible
+// whatever the number of threads or the order in which cells are visited.
+class cell_rng_t
+{
+public:
+    cell_rng_t(uint64_t seed, uint64_t step, uint64_t cell)
+        : key_(mix64(mix64(mix64(seed) ^ step) ^ cell))
+    {
+    }
+
+    uint64_t next()
+    {
+        return mix64(key_ + 0xD1B54A32D192ED03ull * ++draw_);
+    }
+
+    // Uniform double in [0, 1)
+    double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    bool chance(double probability)
+    {
+        return uniform() < probability;
+    }
+
+    // Uniform integer in [0, n)
+    uint32_t below(uint32_t n)
+    {
+        return (uint32_t)(((next() >> 32) * n) >> 32);
+    }
+
+private:
+    uint64_t key_;
+    uint64_t draw_ = 0;
+};
+
+// Stream used for the initial placement of entities, kept apart from every simulation step
+const uint64_t PLACEMENT_STREAM = ~0ull;
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+// Constants
+const uint32_t PLANT_MAXIMUM_AGE = 10;
+const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
+const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
+const uint32_t MAXIMUM_ENERGY = 200;
+const uint32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
+const int32_t INITIAL_ENERGY = 100;
+const int32_t REPRODUCTION_ENERGY_COST = 10;
+const int32_t MOVE_ENERGY_COST = 5;
+const int32_t HERBIVORE_ENERGY_GAIN = 30;
+const int32_t CARNIVORE_ENERGY_GAIN = 20;
+
+// Probabilities
+const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
+const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
+const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
+const double HERBIVORE_MOVE_PROBABILITY = 0.7;
+const double HERBIVORE_EAT_PROBABILITY = 0.9;
+const double CARNIVORE_MOVE_PROBABILITY = 0.5;
+const double CARNIVORE_EAT_PROBABILITY = 1.0;
+
+// Type definitions
+enum entity_type_t
+{
+    empty,
+    plant,
+    herbivore,
+    carnivore
+};
+
+struct pos_t
+{
+    uint32_t i;
+    uint32_t j;
+};
+
+struct entity_t
+{
+    entity_type_t type;
+    int32_t energy;
+    int32_t age;
+};
+
+inline bool operator==(const entity_t &a, const entity_t &b)
+{
+    return a.type == b.type && a.energy == b.energy && a.age == b.age;
+}
+
+inline bool operator!=(const entity_t &a, const entity_t &b)
+{
+    return !(a == b);
+}
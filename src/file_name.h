@@ -0,0 +1,13 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+
+// Names given by clients that become file names, such as checkpoints and recorded runs, are limited to
+// 1 to 128 ASCII letters, digits, '-' and '_', so they can never leave their directory
+inline bool valid_file_name(const std::string &name)
+{
+    return !name.empty() && name.size() <= 128 &&
+           std::all_of(name.begin(), name.end(), [](char c)
+                       { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_'; });
+}
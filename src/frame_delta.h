@@ -0,0 +1,140 @@
+#pragma once
+
+#include "entity.h"
+#include "grid.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// New content of one cell, addressed by its row-major index
+struct cell_change_t
+{
+    uint64_t index;
+    entity_t cell;
+};
+
+// Append to changes every cell of current that differs from previous. Both grids must have the same size.
+inline void diff_grids(const grid_t<entity_t> &previous, const grid_t<entity_t> &current, std::vector<cell_change_t> &changes)
+{
+    for (size_t idx = 0; idx < current.size(); idx++)
+    {
+        if (current[idx] != previous[idx])
+        {
+            changes.push_back({idx, current[idx]});
+        }
+    }
+}
+
+// Fold later, the changes of a following step, into changes. Both are sorted by index and stay so; a cell
+// changed in both keeps its later content. scratch is storage reused from one call to the next.
+inline void merge_changes(std::vector<cell_change_t> &changes, const std::vector<cell_change_t> &later,
+                          std::vector<cell_change_t> &scratch)
+{
+    scratch.clear();
+    size_t k = 0;
+    for (const cell_change_t &change : later)
+    {
+        while (k < changes.size() && changes[k].index < change.index)
+        {
+            scratch.push_back(changes[k++]);
+        }
+        if (k < changes.size() && changes[k].index == change.index)
+        {
+            k++;
+        }
+        scratch.push_back(change);
+    }
+    scratch.insert(scratch.end(), changes.begin() + k, changes.end());
+    changes.swap(scratch);
+}
+
+// Cells that changed between two published frames
+struct frame_delta_t
+{
+    uint64_t from;
+    uint64_t to;
+    std::vector<cell_change_t> changes;
+};
+
+// The most recent deltas, oldest first, each one starting where the previous one ends.
+// Entries are immutable once pushed, so readers may keep them after releasing the owner's lock.
+class delta_history_t
+{
+public:
+    explicit delta_history_t(size_t capacity) : capacity_(capacity) {}
+
+    void clear() { deltas_.clear(); }
+
+    // Bytes held by the changes of the deltas kept
+    size_t memory_usage() const
+    {
+        size_t bytes = 0;
+        for (const auto &delta : deltas_)
+        {
+            bytes += sizeof(frame_delta_t) + delta->changes.capacity() * sizeof(cell_change_t);
+        }
+        return bytes;
+    }
+
+    void push(std::shared_ptr<const frame_delta_t> delta)
+    {
+        if (!deltas_.empty() && deltas_.back()->to != delta->from)
+        {
+            deltas_.clear();
+        }
+        deltas_.push_back(std::move(delta));
+        while (deltas_.size() > capacity_)
+        {
+            deltas_.pop_front();
+        }
+    }
+
+    // The deltas leading from step from to the latest step. Returns false if from is not covered,
+    // because it is older than the history or is not a step that was published.
+    bool chain(uint64_t from, std::vector<std::shared_ptr<const frame_delta_t>> &chain) const
+    {
+        auto first = std::find_if(deltas_.begin(), deltas_.end(),
+                                  [from](const std::shared_ptr<const frame_delta_t> &delta) { return delta->from == from; });
+        if (first == deltas_.end())
+        {
+            return false;
+        }
+        chain.assign(first, deltas_.end());
+        return true;
+    }
+
+private:
+    size_t capacity_;
+    std::deque<std::shared_ptr<const frame_delta_t>> deltas_;
+};
+
+// Fold a chain of deltas into one list of changes, sorted by index, where each cell appears once with its latest content
+inline void merge_deltas(const std::vector<std::shared_ptr<const frame_delta_t>> &chain, std::vector<cell_change_t> &changes)
+{
+    if (chain.size() == 1)
+    {
+        changes = chain.front()->changes;
+        return;
+    }
+    for (const auto &delta : chain)
+    {
+        changes.insert(changes.end(), delta->changes.begin(), delta->changes.end());
+    }
+    // Stable sort keeps the changes of one cell in step order, so the last of each run is the newest
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const cell_change_t &a, const cell_change_t &b) { return a.index < b.index; });
+    size_t kept = 0;
+    for (size_t k = 0; k < changes.size(); k++)
+    {
+        if (k + 1 < changes.size() && changes[k + 1].index == changes[k].index)
+        {
+            continue;
+        }
+        changes[kept++] = changes[k];
+    }
+    changes.resize(kept);
+}
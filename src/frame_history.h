@@ -0,0 +1,182 @@
+#pragma once
+
+#include "binary_frame.h"
+#include "entity.h"
+#include "frame_delta.h"
+#include "grid.h"
+#include "run_recorder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The recent steps of a run, kept in memory as keyframes and deltas in the encodings of run_recorder.h, so any
+// step still in the window can be rebuilt from the nearest keyframe before it. When the entries outgrow the
+// memory cap, the oldest keyframe is dropped together with the deltas that depend on it; the window always
+// keeps at least the latest keyframe and what follows it. A world whose keyframes could outgrow the cap on their
+// own keeps no history at all.
+// Readers only copy references to the entries under the lock and decode them outside it.
+class frame_history_t
+{
+public:
+    // A memory cap of 0 keeps no history
+    frame_history_t(size_t memory_cap, uint32_t keyframe_interval)
+        : memory_cap_(memory_cap), keyframe_interval_(std::max<uint32_t>(1, keyframe_interval)) {}
+
+    // Whether the current world is kept, as decided by reset
+    bool enabled() const { return enabled_; }
+
+    // Start again from grid, the world at step of the given generation. The history stays off if a keyframe of
+    // the grid could be larger than the cap: no keyframe is larger than the packed encoding of every cell.
+    void reset(const grid_t<entity_t> &grid, uint64_t step, uint64_t generation)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_ = generation;
+        entries_.clear();
+        memory_usage_ = 0;
+        num_keyframes_ = 0;
+        enabled_ = memory_cap_ != 0 && estimate_binary_frame_size(grid.size(), grid.size()) <= memory_cap_;
+        if (enabled_)
+        {
+            push(keyframe_record, step, encode_binary_frame(grid, step, generation_));
+        }
+    }
+
+    // Add grid, the world after step, holding population entities, given the cells that changed since the
+    // previous step as a delta payload
+    void append(const grid_t<entity_t> &grid, uint64_t step, uint64_t population, const std::string &delta_payload)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        bool keyframe = prefer_keyframe(grid.size(), population, step - last_keyframe_step_, keyframe_interval_, delta_payload);
+        std::string payload = keyframe ? encode_binary_frame(grid, step, generation_) : delta_payload;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        push(keyframe ? keyframe_record : delta_record, step, std::move(payload));
+        // Drop whole segments, oldest first, while more than one is kept
+        while (memory_usage_ > memory_cap_ && num_keyframes_ > 1)
+        {
+            do
+            {
+                pop_front();
+            } while (entries_.front().kind != keyframe_record);
+        }
+    }
+
+    // Rebuild the world at step of the given generation into grid. Returns false if it is outside the window.
+    bool rebuild(uint64_t generation, uint64_t step, grid_t<entity_t> &grid) const
+    {
+        std::vector<std::shared_ptr<const std::string>> payloads;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (generation != generation_ || entries_.empty() || step < entries_.front().step || step > entries_.back().step)
+            {
+                return false;
+            }
+            // Steps are consecutive, so the entry of step is found by its distance from the first one
+            size_t last = step - entries_.front().step;
+            size_t first = last;
+            while (entries_[first].kind != keyframe_record)
+            {
+                first--;
+            }
+            for (size_t k = first; k <= last; k++)
+            {
+                payloads.push_back(entries_[k].payload);
+            }
+        }
+
+        uint64_t frame_step;
+        uint64_t frame_generation;
+        if (!decode_binary_frame(payloads.front()->data(), payloads.front()->size(), grid, frame_step, frame_generation))
+        {
+            return false;
+        }
+        for (size_t k = 1; k < payloads.size(); k++)
+        {
+            if (!apply_delta_payload(*payloads[k], grid))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Generation and oldest and newest step in the window; false if the window is empty
+    bool window(uint64_t &generation, uint64_t &first_step, uint64_t &last_step) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.empty())
+        {
+            return false;
+        }
+        generation = generation_;
+        first_step = entries_.front().step;
+        last_step = entries_.back().step;
+        return true;
+    }
+
+    size_t memory_usage() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return memory_usage_;
+    }
+
+private:
+    struct entry_t
+    {
+        uint64_t step;
+        run_record_kind_t kind;
+        std::shared_ptr<const std::string> payload;
+    };
+
+    // Called with mutex_ held
+    void push(run_record_kind_t kind, uint64_t step, std::string payload)
+    {
+        // A step that does not follow the last one starts a new window
+        if (!entries_.empty() && step != entries_.back().step + 1)
+        {
+            entries_.clear();
+            memory_usage_ = 0;
+            num_keyframes_ = 0;
+        }
+        if (entries_.empty() && kind != keyframe_record)
+        {
+            return;
+        }
+        memory_usage_ += sizeof(entry_t) + payload.capacity();
+        entries_.push_back({step, kind, std::make_shared<const std::string>(std::move(payload))});
+        if (kind == keyframe_record)
+        {
+            num_keyframes_++;
+            last_keyframe_step_ = step;
+        }
+    }
+
+    void pop_front()
+    {
+        memory_usage_ -= sizeof(entry_t) + entries_.front().payload->capacity();
+        if (entries_.front().kind == keyframe_record)
+        {
+            num_keyframes_--;
+        }
+        entries_.pop_front();
+    }
+
+    size_t memory_cap_;
+    uint32_t keyframe_interval_;
+    // Written by reset and read by the writer of the history only
+    bool enabled_ = false;
+    mutable std::mutex mutex_;
+    uint64_t generation_ = 0;
+    std::deque<entry_t> entries_;
+    size_t memory_usage_ = 0;
+    size_t num_keyframes_ = 0;
+    uint64_t last_keyframe_step_ = 0;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "entity.h"
+#include "grid.h"
+
+#include <charconv>
+#include <cstddef>
+#include <string>
+
+// Writes the grid as JSON text directly from the cells, without building an nlohmann::json tree.
+// The output is byte-identical to nlohmann::json(grid).dump(): an array of rows of
+// {"age":A,"energy":E,"type":"T"} objects, keys in the sorted order nlohmann uses.
+// The text goes straight into the caller's string, which write() sizes from the previous frame, so each
+// frame costs one allocation and is never copied.
+class frame_writer_t
+{
+public:
+    // JSON text of grid in a string of its own, e.g. the body of a frame
+    std::string write(const grid_t<entity_t> &grid)
+    {
+        std::string out;
+        out.reserve(last_size_);
+        append(grid, out);
+        last_size_ = out.size();
+        return out;
+    }
+
+    // Append the JSON text of grid to out, e.g. inside a larger document
+    static void append(const grid_t<entity_t> &grid, std::string &out)
+    {
+        out.push_back('[');
+        for (uint32_t i = 0; i < grid.height(); i++)
+        {
+            if (i > 0)
+            {
+                out.push_back(',');
+            }
+            out.push_back('[');
+            const entity_t *row = grid.row(i);
+            for (uint32_t j = 0; j < grid.width(); j++)
+            {
+                if (j > 0)
+                {
+                    out.push_back(',');
+                }
+                append_cell(row[j], out);
+            }
+            out.push_back(']');
+        }
+        out.push_back(']');
+    }
+
+    // Forget the size of the previous frame, e.g. before writing a smaller world
+    void release() { last_size_ = 0; }
+
+private:
+    static void append_cell(const entity_t &cell, std::string &out)
+    {
+        // Most cells are empty
+        if (cell.type == empty && cell.age == 0 && cell.energy == 0)
+        {
+            out.append(EMPTY_CELL, sizeof(EMPTY_CELL) - 1);
+            return;
+        }
+        out.append(AGE_KEY, sizeof(AGE_KEY) - 1);
+        append_int(cell.age, out);
+        out.append(ENERGY_KEY, sizeof(ENERGY_KEY) - 1);
+        append_int(cell.energy, out);
+        out.append(TYPE_SUFFIXES[cell.type & 3], TYPE_SUFFIX_SIZE);
+    }
+
+    static void append_int(int32_t value, std::string &out)
+    {
+        char digits[16];
+        char *end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        out.append(digits, end - digits);
+    }
+
+    static constexpr char EMPTY_CELL[] = "{\"age\":0,\"energy\":0,\"type\":\" \"}";
+    static constexpr char AGE_KEY[] = "{\"age\":";
+    static constexpr char ENERGY_KEY[] = ",\"energy\":";
+    // Indexed by entity_type_t
+    static constexpr const char *TYPE_SUFFIXES[4] = {",\"type\":\" \"}", ",\"type\":\"P\"}", ",\"type\":\"H\"}", ",\"type\":\"C\"}"};
+    static constexpr size_t TYPE_SUFFIX_SIZE = 12;
+
+    size_t last_size_ = 0;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Contiguous row-major 2D grid whose dimensions are chosen at runtime.
+// Cell (i, j) lives at index i * width + j, so a whole world is a single allocation.
+// The cells are normally owned by the grid, but a grid can also adopt cells that live elsewhere, such as a
+// memory-mapped checkpoint, and then reads and writes them in place.
+template <typename T>
+class grid_t
+{
+public:
+    grid_t() = default;
+
+    grid_t(uint32_t height, uint32_t width, const T &value = T())
+    {
+        assign(height, width, value);
+    }
+
+    // Copies always own their cells
+    grid_t(const grid_t &other) : height_(other.height_), width_(other.width_)
+    {
+        cells_.assign(other.data_, other.data_ + other.size_);
+        data_ = cells_.data();
+        size_ = cells_.size();
+    }
+
+    grid_t(grid_t &&other) noexcept
+    {
+        swap(other);
+    }
+
+    grid_t &operator=(const grid_t &other)
+    {
+        if (this != &other)
+        {
+            mapping_.reset();
+            if (cells_.capacity() > other.size_)
+            {
+                std::vector<T>().swap(cells_);
+            }
+            cells_.assign(other.data_, other.data_ + other.size_);
+            height_ = other.height_;
+            width_ = other.width_;
+            data_ = cells_.data();
+            size_ = cells_.size();
+        }
+        return *this;
+    }
+
+    grid_t &operator=(grid_t &&other) noexcept
+    {
+        grid_t moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+
+    // Resize the grid and fill every cell with value. Storage left over from a larger grid is released.
+    void assign(uint32_t height, uint32_t width, const T &value = T())
+    {
+        height_ = height;
+        width_ = width;
+        mapping_.reset();
+        if (cells_.capacity() > static_cast<size_t>(height) * width)
+        {
+            std::vector<T>().swap(cells_);
+        }
+        cells_.assign(static_cast<size_t>(height) * width, value);
+        data_ = cells_.data();
+        size_ = cells_.size();
+    }
+
+    // Use height * width cells stored at cells, which owner keeps alive for as long as the grid uses them
+    void adopt(uint32_t height, uint32_t width, T *cells, std::shared_ptr<void> owner)
+    {
+        std::vector<T>().swap(cells_);
+        height_ = height;
+        width_ = width;
+        mapping_ = std::move(owner);
+        data_ = cells;
+        size_ = static_cast<size_t>(height) * width;
+    }
+
+    // Overwrite every cell with value, keeping the dimensions
+    void fill(const T &value)
+    {
+        std::fill(data_, data_ + size_, value);
+    }
+
+    // Release the storage and leave an empty 0x0 grid
+    void clear()
+    {
+        height_ = 0;
+        width_ = 0;
+        std::vector<T>().swap(cells_);
+        mapping_.reset();
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    void swap(grid_t &other) noexcept
+    {
+        std::swap(height_, other.height_);
+        std::swap(width_, other.width_);
+        cells_.swap(other.cells_);
+        mapping_.swap(other.mapping_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+    }
+
+    uint32_t height() const { return height_; }
+    uint32_t width() const { return width_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    // Bytes of cell storage held, including spare capacity and adopted cells
+    size_t memory_usage() const { return mapping_ ? size_ * sizeof(T) : cells_.capacity() * sizeof(T); }
+
+    bool contains(int64_t i, int64_t j) const
+    {
+        return i >= 0 && j >= 0 && i < height_ && j < width_;
+    }
+
+    size_t index(uint32_t i, uint32_t j) const
+    {
+        return static_cast<size_t>(i) * width_ + j;
+    }
+
+    T &operator()(uint32_t i, uint32_t j) { return data_[index(i, j)]; }
+    const T &operator()(uint32_t i, uint32_t j) const { return data_[index(i, j)]; }
+
+    T &operator[](size_t idx) { return data_[idx]; }
+    const T &operator[](size_t idx) const { return data_[idx]; }
+
+    T *row(uint32_t i) { return data_ + index(i, 0); }
+    const T *row(uint32_t i) const { return data_ + index(i, 0); }
+
+    T *data() { return data_; }
+    const T *data() const { return data_; }
+
+    T *begin() { return data_; }
+    T *end() { return data_ + size_; }
+    const T *begin() const { return data_; }
+    const T *end() const { return data_ + size_; }
+
+private:
+    uint32_t height_ = 0;
+    uint32_t width_ = 0;
+    std::vector<T> cells_;
+    // Keeps adopted cells alive; null when the grid owns its cells in cells_
+    std::shared_ptr<void> mapping_;
+    T *data_ = nullptr;
+    size_t size_ = 0;
+};
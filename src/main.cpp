@@ -2,254 +2,288 @@
 #define CROW_STATIC_DIR "../public"
 
 #include "crow_all.h"
+#include "checkpoint.h"
+#include "compression.h"
+#include "frame_writer.h"
 #include "json.hpp"
-#include <random>
-#include <vector>
-#include <utility>
+#include "run_recorder.h"
+#include "representation_cache.h"
+#include "session.h"
+#include "simulation.h"
+#include "simulation_loop.h"
+#include "thread_pool.h"
+#include "wire_format.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <vector>
 
-static const uint32_t NUM_ROWS = 15;
-
-// Constants
-const uint32_t PLANT_MAXIMUM_AGE = 10;
-const uint32_t HERBIVORE_MAXIMUM_AGE = 50;
-const uint32_t CARNIVORE_MAXIMUM_AGE = 80;
-const uint32_t MAXIMUM_ENERGY = 200;
-const uint32_t THRESHOLD_ENERGY_FOR_REPRODUCTION = 20;
-
-// Probabilities
-const double PLANT_REPRODUCTION_PROBABILITY = 0.2;
-const double HERBIVORE_REPRODUCTION_PROBABILITY = 0.075;
-const double CARNIVORE_REPRODUCTION_PROBABILITY = 0.025;
-const double HERBIVORE_MOVE_PROBABILITY = 0.7;
-const double HERBIVORE_EAT_PROBABILITY = 0.9;
-const double CARNIVORE_MOVE_PROBABILITY = 0.5;
-const double CARNIVORE_EAT_PROBABILITY = 1.0;
-
-// Type definitions
-enum entity_type_t
-{
-    empty,
-    plant,
-    herbivore,
-    carnivore
-};
+// Workers shared by the steps of every session, started together with the server
+static std::unique_ptr<thread_pool_t> worker_pool;
 
-struct pos_t
+// Decode a request body according to its Content-Type into body; an empty body reads as {}.
+// Answers 400 and returns false if the body cannot be decoded.
+static bool read_body(const crow::request &req, crow::response &res, nlohmann::json &body)
 {
-    uint32_t i;
-    uint32_t j;
-};
+    try
+    {
+        body = req.body.empty() ? nlohmann::json::object() : decode_body(req.body, request_format(req.get_header_value("Content-Type")));
+        return true;
+    }
+    catch (const nlohmann::json::exception &)
+    {
+        res.code = 400;
+        res.body = "Invalid request body";
+        res.end();
+        return false;
+    }
+}
 
-struct entity_t
+// Set the body of a response in the format asked for by the Accept header of the request
+static void write_body(const crow::request &req, crow::response &res, const nlohmann::json &value)
 {
-    entity_type_t type;
-    int32_t energy;
-    int32_t age;
-    std::mutex* mutex;
-};
-
-// Grid that contains the entities
-static std::vector<std::vector<entity_t>> entity_grid;
-
-// std::vector<pos_t> empty_positions, plant_positions, herb_positions;
-std::vector<pos_t> already_atualized_pos; //, new_plants, new_herbs, new_carns;
-// std::vector<std::pair<pos_t,pos_t>> herb_move, carn_move, plant_eated, herb_eated;
+    wire_format_t format = negotiate_format(req.get_header_value("Accept"));
+    res.set_header("Content-Type", content_type_of(format));
+    res.set_header("Vary", "Accept");
+    res.body = encode_body(value, format);
+}
 
-bool random_action(float probability)
+// Set the body of a response to JSON text, converted to the format asked for by the Accept header of the request
+static void write_json_text(const crow::request &req, crow::response &res, std::string text)
 {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(0.0, 1.0);
-    return dis(gen) < probability;
+    wire_format_t format = negotiate_format(req.get_header_value("Accept"));
+    res.set_header("Content-Type", content_type_of(format));
+    res.set_header("Vary", "Accept");
+    res.body = format == json_format ? std::move(text) : encode_body(nlohmann::json::parse(text), format);
 }
 
-pos_t pick_random_cell(std::vector<pos_t> positions)
+// Session named by ?session=ID, or the most recently started one when the request names none, so
+// single-user clients need not know about sessions. Answers 404 and returns nullptr if there is no such session.
+static std::shared_ptr<session_t> find_session(const session_registry_t &sessions, const crow::request &req, crow::response &res)
 {
-    int rand_index = rand() % positions.size();
-    return positions[rand_index];
+    const char *id = req.url_params.get("session");
+    std::shared_ptr<session_t> session = sessions.find(id == nullptr ? "" : id);
+    if (!session)
+    {
+        res.code = 404;
+        res.body = id == nullptr ? "No simulation started" : "Unknown session";
+        res.end();
+    }
+    return session;
 }
 
-bool check_cell(pos_t pos, std::vector<pos_t> &already_atualized_pos)
+// Upper bound on the steps a single POST /run may ask for
+static const uint64_t MAXIMUM_STEPS_PER_RUN = 1000000;
+// Upper bound on the cells of all the frames one POST /run returns, about 140 MB of JSON
+static const uint64_t MAXIMUM_CELLS_PER_RUN = 4000000;
+
+// Command line options of the server
+struct server_options_t
 {
-    for (auto &it : already_atualized_pos)
+    uint16_t port = 8080;
+    size_t num_threads = 0; // 0 means std::thread::hardware_concurrency()
+    uint32_t tile_size = DEFAULT_TILE_SIZE; // used when /start-simulation does not pick one
+    scheduling_policy_t scheduler = work_stealing;
+    int compression_level = 0; // 1 to 9 compresses frame responses for clients that accept it, 0 never does
+    size_t compression_min_size = 1024; // bodies smaller than this are sent as they are
+    size_t memory_budget = 0; // bytes all sessions together may hold, 0 for no limit
+    uint64_t session_idle_timeout = 3600; // seconds without requests or viewers after which a session is dropped, 0 for never
+    std::string checkpoint_dir = "checkpoints"; // where POST /checkpoint writes and POST /restore reads
+    std::string record_dir = "runs"; // where recorded runs are written and GET /replay reads them
+    uint32_t keyframe_interval = DEFAULT_KEYFRAME_INTERVAL; // steps between the keyframes of a recorded run or history
+    size_t history_memory = 0; // bytes of past steps each session keeps for GET /frame/<step>, 0 for none
+};
+
+server_options_t parse_options(int argc, char *argv[])
+{
+    server_options_t options;
+    for (int k = 1; k < argc; k++)
     {
-        if (it.i == pos.i && it.j == pos.j)
+        if (std::strcmp(argv[k], "--threads") == 0 && k + 1 < argc)
         {
-            return false;
+            options.num_threads = std::strtoul(argv[++k], nullptr, 10);
         }
-    }
-    return true;
-}
-
-std::vector<pos_t> check_spec_type(pos_t pos, entity_type_t type){
-    pos_t valid_position;
-    std::vector<pos_t> val_positions;
-    int i = pos.i;
-    int j = pos.j;
-    if(i + 1 < NUM_ROWS){
-        if(check_cell(valid_position, already_atualized_pos)){
-            if(entity_grid[i+1][j].type == type){
-                valid_position.i = i+1;
-                valid_position.j = j;
-                val_positions.push_back(valid_position);
-            }
+        else if (std::strcmp(argv[k], "--tile-size") == 0 && k + 1 < argc)
+        {
+            options.tile_size = std::max<uint32_t>(tile_schedule_t::MINIMUM_TILE_SIZE, std::strtoul(argv[++k], nullptr, 10));
         }
-    }
-    if(j + 1 < NUM_ROWS){
-        if(check_cell(valid_position, already_atualized_pos)){
-            if(entity_grid[i][j+1].type == type){
-                valid_position.i = i;
-                valid_position.j = j+1;
-                val_positions.push_back(valid_position);
-            }
+        else if (std::strcmp(argv[k], "--scheduler") == 0 && k + 1 < argc && std::strcmp(argv[k + 1], "static") == 0)
+        {
+            options.scheduler = static_split;
+            k++;
         }
-    }
-    if(i - 1 >= 0){
-        if(check_cell(valid_position, already_atualized_pos)){
-            if(entity_grid[i-1][j].type == type){
-                valid_position.i = i-1;
-                valid_position.j = j;
-                val_positions.push_back(valid_position);
-            }
+        else if (std::strcmp(argv[k], "--scheduler") == 0 && k + 1 < argc && std::strcmp(argv[k + 1], "work-stealing") == 0)
+        {
+            options.scheduler = work_stealing;
+            k++;
         }
-    }
-    if(j - 1 >= 0){
-        if(check_cell(valid_position, already_atualized_pos)){
-            if(entity_grid[i][j-1].type == type){
-                valid_position.i = i;
-                valid_position.j = j-1;
-                val_positions.push_back(valid_position);
-            }
+        else if (std::strcmp(argv[k], "--compression-level") == 0 && k + 1 < argc)
+        {
+            options.compression_level = std::min(9, std::max(0, std::atoi(argv[++k])));
+        }
+        else if (std::strcmp(argv[k], "--compression-min-size") == 0 && k + 1 < argc)
+        {
+            options.compression_min_size = std::strtoul(argv[++k], nullptr, 10);
+        }
+        else if (std::strcmp(argv[k], "--memory-budget") == 0 && k + 1 < argc)
+        {
+            options.memory_budget = std::strtoull(argv[++k], nullptr, 10) << 20;
+        }
+        else if (std::strcmp(argv[k], "--session-idle-timeout") == 0 && k + 1 < argc)
+        {
+            options.session_idle_timeout = std::strtoull(argv[++k], nullptr, 10);
+        }
+        else if (std::strcmp(argv[k], "--checkpoint-dir") == 0 && k + 1 < argc)
+        {
+            options.checkpoint_dir = argv[++k];
+        }
+        else if (std::strcmp(argv[k], "--record-dir") == 0 && k + 1 < argc)
+        {
+            options.record_dir = argv[++k];
+        }
+        else if (std::strcmp(argv[k], "--keyframe-interval") == 0 && k + 1 < argc)
+        {
+            options.keyframe_interval = std::max<uint32_t>(1, std::strtoul(argv[++k], nullptr, 10));
+        }
+        else if (std::strcmp(argv[k], "--history-memory") == 0 && k + 1 < argc)
+        {
+            options.history_memory = std::strtoull(argv[++k], nullptr, 10) << 20;
+        }
+        else if (std::strcmp(argv[k], "--port") == 0 && k + 1 < argc)
+        {
+            options.port = (uint16_t)std::strtoul(argv[++k], nullptr, 10);
+        }
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--threads N] [--tile-size N] [--scheduler static|work-stealing]\n"
+                                 "          [--compression-level 0-9] [--compression-min-size BYTES]\n"
+                                 "          [--memory-budget MEGABYTES] [--session-idle-timeout SECONDS]\n"
+                                 "          [--checkpoint-dir DIR] [--record-dir DIR] [--keyframe-interval STEPS]\n"
+                                 "          [--history-memory MEGABYTES] [--port PORT]\n", argv[0]);
+            std::exit(1);
         }
     }
-    return val_positions;
+    return options;
 }
 
-void lock_surroundings(pos_t pos){
-    entity_grid[pos.i][pos.j].mutex->lock();
-    if(pos.i + 1 < NUM_ROWS){
-        entity_grid[pos.i+1][pos.j].mutex->lock();
-    }
-    if(pos.j + 1 < NUM_ROWS){
-       entity_grid[pos.i][pos.j+1].mutex->lock();
-    }
-    if(pos.i - 1 >= 0){
-        entity_grid[pos.i-1][pos.j].mutex->lock();
-    }
-    if(pos.j - 1 >= 0){
-       entity_grid[pos.i][pos.j-1].mutex->lock();
-    }
+// Record every step of the session's current run from now on; called with the session mutex held
+static std::string start_recording(session_t &session, const server_options_t &options)
+{
+    ::mkdir(options.record_dir.c_str(), 0755);
+    return session.record(options.record_dir, options.keyframe_interval);
 }
 
-void unlock_surroundings(pos_t pos){
-    entity_grid[pos.i][pos.j].mutex->unlock();
-    if(pos.i + 1 < NUM_ROWS){
-        entity_grid[pos.i+1][pos.j].mutex->unlock();
-    }
-    if(pos.j + 1 < NUM_ROWS){
-       entity_grid[pos.i][pos.j+1].mutex->unlock();
-    }
-    if(pos.i - 1 >= 0){
-        entity_grid[pos.i-1][pos.j].mutex->unlock();
+// Compress a body with gzip or deflate if the server is configured to and the body is large enough.
+// It runs on the I/O thread serving the request, outside the session mutex; frame variants are compressed
+// once and the result shared by every reader, see serve_frame.
+static void compress_representation(representation_t &representation, content_encoding_t encoding, const server_options_t &options)
+{
+    if (options.compression_level == 0 || encoding == identity_encoding ||
+        representation.body.size() < options.compression_min_size)
+    {
+        return;
     }
-    if(pos.j - 1 >= 0){
-       entity_grid[pos.i][pos.j-1].mutex->unlock();
+
+    std::string compressed;
+    if (compress_body(representation.body, encoding, options.compression_level, compressed))
+    {
+        representation.body = std::move(compressed);
+        representation.content_encoding = encoding_name(encoding);
     }
 }
 
-void simulate_plant(pos_t pos){
-    lock_surroundings(pos);
-    if(entity_grid[pos.i][pos.j].age == PLANT_MAXIMUM_AGE){
-        entity_grid[pos.i][pos.j].type = empty;
-        entity_grid[pos.i][pos.j].age = 0;
-        unlock_surroundings(pos);
-    } else if(random_action(PLANT_REPRODUCTION_PROBABILITY)){
-        std::vector<pos_t> empty_positions = check_spec_type(pos, empty);
-        if(!empty_positions.empty()){
-            pos_t chose_position = pick_random_cell(empty_positions);
-            entity_grid[chose_position.i][chose_position.j].type = plant;
-            entity_grid[chose_position.i][chose_position.j].age = 0;
-            already_atualized_pos.push_back(chose_position);
-        } 
-        entity_grid[pos.i][pos.j].age++;
-        unlock_surroundings(pos);
-    } else {
-        entity_grid[pos.i][pos.j].age++;
-        unlock_surroundings(pos);
-    }
+static content_encoding_t accepted_encoding(const crow::request &req, const server_options_t &options)
+{
+    return options.compression_level == 0 ? identity_encoding : negotiate_encoding(req.get_header_value("Accept-Encoding"));
 }
 
-// void simulate_herb(pos_t pos){
-//     int i = pos.i;
-//     int j = pos.j;
-//     if(entity_grid[i][j].age == 50 || entity_grid[i][j].energy == 0){
-//         entity_grid[i][j].type = empty;
-//         entity_grid[i][j].age = 0;
-//         entity_grid[i][j].energy = 0;
-//     } else if(random_action(HERBIVORE_REPRODUCTION_PROBABILITY) && 
-//                 entity_grid[i][j].energy > THRESHOLD_ENERGY_FOR_REPRODUCTION &&
-//                 !empty_positions.empty()){
-//             entity_grid[i][j].energy = entity_grid[i][j].energy - 10;
-//             pos_t chose_position = pick_random_cell(empty_positions);
-//             new_herbs.push_back(chose_position);
-//             already_atualized_pos.push_back(chose_position);
-//     } else if(random_action(HERBIVORE_EAT_PROBABILITY) && !plant_positions.empty()){
-//             pos_t chose_position = pick_random_cell(plant_positions);
-//             plant_eated.push_back(std::make_pair(pos, chose_position));
-//             already_atualized_pos.push_back(chose_position);
-//     } else if(random_action(HERBIVORE_MOVE_PROBABILITY) && !empty_positions.empty()){
-//             pos_t chose_position = pick_random_cell(empty_positions);
-//             herb_move.push_back(std::make_pair(pos, chose_position));
-//             already_atualized_pos.push_back(chose_position);
-//     } else entity_grid[i][j].age++;
-// }
-
-// void simulate_carn(pos_t pos){
-//     int i = pos.i;
-//     int j = pos.j;
-//     if(entity_grid[i][j].age == 80 || entity_grid[i][j].energy == 0){
-//         entity_grid[i][j].type = empty;
-//         entity_grid[i][j].age = 0;
-//         entity_grid[i][j].energy = 0;
-//     } else if(random_action(CARNIVORE_REPRODUCTION_PROBABILITY) && 
-//                 entity_grid[i][j].energy > THRESHOLD_ENERGY_FOR_REPRODUCTION &&
-//                 !empty_positions.empty()){
-//             entity_grid[i][j].energy = entity_grid[i][j].energy - 10;
-//             pos_t chose_position = pick_random_cell(empty_positions);
-//             new_carns.push_back(chose_position);
-//             already_atualized_pos.push_back(chose_position);
-//     } else if(random_action(CARNIVORE_EAT_PROBABILITY) && !herb_positions.empty()){
-//             pos_t chose_position = pick_random_cell(herb_positions);
-//             herb_eated.push_back(std::make_pair(pos, chose_position));
-//             already_atualized_pos.push_back(chose_position);
-//     } else if(random_action(CARNIVORE_MOVE_PROBABILITY) && !empty_positions.empty()){
-//             pos_t chose_position = pick_random_cell(empty_positions);
-//             carn_move.push_back(std::make_pair(pos, chose_position));
-//             already_atualized_pos.push_back(chose_position);
-//     } else entity_grid[i][j].age++;
-// }
-
-// Auxiliary code to convert the entity_type_t enum to a string
-NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
-                                                {empty, " "},
-                                                {plant, "P"},
-                                                {herbivore, "H"},
-                                                {carnivore, "C"},
-                                            })
-
-// Auxiliary code to convert the entity_t struct to a JSON object
-namespace nlohmann
+// Compress the body of a response that is not cached, such as the result of POST /run
+static void compress_response(const crow::request &req, crow::response &res, const server_options_t &options)
 {
-    void to_json(nlohmann::json &j, const entity_t &e)
+    if (options.compression_level == 0)
+    {
+        return;
+    }
+    res.add_header("Vary", "Accept-Encoding");
+    representation_t representation;
+    representation.body = std::move(res.body);
+    compress_representation(representation, accepted_encoding(req, options), options);
+    res.body = std::move(representation.body);
+    if (!representation.content_encoding.empty())
     {
-        j = nlohmann::json{{"type", e.type}, {"energy", e.energy}, {"age", e.age}};
+        res.set_header("Content-Encoding", representation.content_encoding);
     }
 }
 
+// Serve one variant of a frame, such as the grid, a keyframe message or the delta since some step.
+// make_body returns the variant as JSON text, or as the bytes to send for binary variants; JSON is then
+// converted to the format the Accept header asks for and compressed if the client accepts it.
+// Each variant is built once per frame and the same bytes are handed to every reader. The ETag names the
+// generation, the step and the variant, so a client that already holds it gets 304 Not Modified.
+static void serve_frame(const crow::request &req, crow::response &res, const server_options_t &options, const frame_t &frame,
+                        const std::string &variant, bool binary, const std::function<std::string()> &make_body)
+{
+    wire_format_t format = binary ? json_format : negotiate_format(req.get_header_value("Accept"));
+    content_encoding_t encoding = accepted_encoding(req, options);
+    std::string key = (binary ? variant : variant + "-" + format_name(format)) + "-" + encoding_name(encoding);
+    std::string etag = "\"" + std::to_string(frame.generation) + "-" + std::to_string(frame.step) + "-" + key + "\"";
 
-int main()
+    res.set_header("X-Simulation-Step", std::to_string(frame.step));
+    res.set_header("X-Simulation-Generation", std::to_string(frame.generation));
+    res.set_header("ETag", etag);
+    if (!binary)
+    {
+        res.add_header("Vary", "Accept");
+    }
+    if (options.compression_level != 0)
+    {
+        res.add_header("Vary", "Accept-Encoding");
+    }
+    std::string if_none_match = req.get_header_value("If-None-Match");
+    if (if_none_match == "*" || if_none_match.find(etag) != std::string::npos)
+    {
+        res.code = 304;
+        return;
+    }
+
+    auto build = [&]()
+    {
+        representation_t built;
+        built.body = make_body();
+        if (binary)
+        {
+            built.content_type = "application/octet-stream";
+        }
+        else
+        {
+            built.content_type = content_type_of(format);
+            if (format != json_format)
+            {
+                built.body = encode_body(nlohmann::json::parse(built.body), format);
+            }
+        }
+        compress_representation(built, encoding, options);
+        return built;
+    };
+    std::shared_ptr<const representation_t> representation = frame.representations.get(key, build);
+    res.set_header("Content-Type", representation->content_type);
+    if (!representation->content_encoding.empty())
+    {
+        res.set_header("Content-Encoding", representation->content_encoding);
+    }
+    res.body = representation->body;
+}
+
+int main(int argc, char *argv[])
 {
+    server_options_t options = parse_options(argc, argv);
+    worker_pool.reset(new thread_pool_t(options.num_threads));
+
     crow::SimpleApp app;
 
     // Endpoint to serve the HTML page
@@ -260,127 +294,763 @@ int main()
         res.set_static_file_info_unsafe("../public/index.html");
         res.end(); });
 
+    // Every world hosted by the server
+    session_settings_t session_settings;
+    session_settings.policy = options.scheduler;
+    session_settings.history_memory = options.history_memory;
+    session_settings.keyframe_interval = options.keyframe_interval;
+    session_registry_t sessions(worker_pool.get(), session_settings, options.memory_budget,
+                                std::chrono::seconds(options.session_idle_timeout));
+
+    // Clock dropping idle sessions, checked once a second
+    simulation_loop_t session_reaper([&sessions]()
+                                     { sessions.drop_idle(); });
+    session_reaper.resume();
+
+    // Endpoint to start a simulation. Without ?session=ID it starts a new session; with one it restarts that session.
     CROW_ROUTE(app, "/start-simulation")
-        .methods("POST"_method)([](crow::request &req, crow::response &res)
+        .methods("POST"_method)([&options, &sessions, &session_settings](crow::request &req, crow::response &res)
                                 { 
-        // Parse the JSON request body
-        nlohmann::json request_body = nlohmann::json::parse(req.body);
+        // Parse the request body, JSON unless Content-Type names CBOR or MessagePack
+        nlohmann::json request_body;
+        if (!read_body(req, res, request_body)) {
+            return;
+        }
 
-       // Validate the request body 
-        uint32_t total_entinties = (uint32_t)request_body["plants"] + (uint32_t)request_body["herbivores"] + (uint32_t)request_body["carnivores"];
-        if (total_entinties > NUM_ROWS * NUM_ROWS) {
+        // Validate the request body 
+        simulation_params_t params;
+        std::string error = parse_simulation_params(request_body, options.tile_size, params);
+        if (error.empty() && request_body.contains("record") && !request_body["record"].is_boolean()) {
+            error = "Invalid request body";
+        }
+        if (!error.empty()) {
         res.code = 400;
-        res.body = "Too many entities";
+        res.body = error;
         res.end();
         return;
         }
 
-        // Clear the entity grid
-        entity_grid.clear();
-        entity_grid.assign(NUM_ROWS, std::vector<entity_t>(NUM_ROWS, {empty, 0, 0, new std::mutex()}));
-        for(int i = 0; i < NUM_ROWS; i++){
-            for(int j = 0; i < NUM_ROWS; i++){
-                entity_grid[i][j].mutex = new std::mutex();
-            }
+        std::shared_ptr<session_t> session;
+        if (req.url_params.get("session") != nullptr && !(session = find_session(sessions, req, res))) {
+            return;
+        }
+        // Drop idle sessions if the new world would not fit in the memory budget otherwise
+        if (!sessions.make_room(session_t::estimate_memory(params, session_settings), session.get())) {
+        res.code = 503;
+        res.body = "Memory budget exceeded";
+        res.end();
+        return;
         }
-        
-        // Create the entities
-        int i;
-        int row, col;
-        for(i = 0; i < (uint32_t)request_body["plants"]; i++){
-            static std::random_device rd;
-            static std::mt19937 gen(rd());
-            std::uniform_int_distribution<> dis(0, 14);
-            row = dis(gen);
-            col = dis(gen);
-
-            while(!entity_grid[row][col].type == empty){
-                row = dis(gen);
-                col = dis(gen);
+        if (!session) {
+            session = sessions.create();
+        }
+
+        // Create the entities, and record the run from its first step if asked to with {"record": true}
+        std::unique_lock<std::mutex> lock(session->mutex);
+        session->start(params);
+        std::string record_error = request_body.value("record", false) ? start_recording(*session, options) : "";
+        std::shared_ptr<const frame_t> frame = session->publish_frame();
+        lock.unlock();
+        if (!record_error.empty()) {
+        res.code = 500;
+        res.body = record_error;
+        res.end();
+        return;
+        }
+
+        // Return the entity grid, encoded as asked for by the Accept header
+        res.set_header("X-Session-Id", session->id());
+        if (request_body.value("record", false)) {
+            res.set_header("X-Run-Id", session->run_name());
+        }
+        res.set_header("X-Simulation-Seed", std::to_string(params.seed));
+        serve_frame(req, res, options, *frame, "grid", false, [&]() { return frame->body; });
+        res.end(); });
+
+    // Endpoint to process HTTP GET requests for the next simulation iteration
+    CROW_ROUTE(app, "/next-iteration")
+        .methods("GET"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(session->mutex);
+        session->step();
+        std::shared_ptr<const frame_t> frame = session->publish_frame();
+        lock.unlock();
+
+        // Return the entity grid, encoded as asked for by the Accept header
+        serve_frame(req, res, options, *frame, "grid", false, [&]() { return frame->body; });
+        res.end(); });
+
+    // Endpoint to advance many steps in one request, returning only the frames asked for
+    CROW_ROUTE(app, "/run")
+        .methods("POST"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                                {
+        // Parse the request body: {"steps": N, "emit_every": K, "counts": true}
+        nlohmann::json request_body;
+        if (!read_body(req, res, request_body)) {
+            return;
+        }
+        uint64_t steps;
+        uint64_t emit_every;
+        if (!request_body.is_object() || !read_unsigned(request_body, "steps", 1, steps) ||
+            !read_unsigned(request_body, "emit_every", 0, emit_every) ||
+            (request_body.contains("counts") && !request_body["counts"].is_boolean())) {
+        res.code = 400;
+        res.body = "Invalid request body";
+        res.end();
+        return;
+        }
+        bool include_counts = request_body.value("counts", false);
+        if (steps == 0 || steps > MAXIMUM_STEPS_PER_RUN) {
+        res.code = 400;
+        res.body = "Invalid number of steps";
+        res.end();
+        return;
+        }
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(session->mutex);
+        const simulation_t &simulation = session->simulation();
+        // A frame at each multiple of emit_every plus the final one, each the size of the grid
+        const uint64_t max_frames = emit_every == 0 ? 1 : std::min(steps, steps / emit_every + 2);
+        if (max_frames * simulation.grid().size() > MAXIMUM_CELLS_PER_RUN) {
+        res.code = 400;
+        res.body = "Too many frames requested";
+        res.end();
+        return;
+        }
+        // The result is written as JSON text, keys in the sorted order nlohmann uses, and the grids straight from
+        // the cells: {"counts": [{"carnivores": c, "herbivores": h, "plants": p, "step": n}, ...],
+        // "frames": [{"grid": ..., "step": n}, ...], "step": n}
+        std::string counts = "[";
+        std::string frames = "[";
+        for (uint64_t k = 1; k <= steps; k++) {
+            session->step();
+            if (include_counts) {
+                population_t population = simulation.stats().population();
+                counts += (counts.size() > 1 ? ",{\"carnivores\":" : "{\"carnivores\":") + std::to_string(population.carnivores) +
+                          ",\"herbivores\":" + std::to_string(population.herbivores) + ",\"plants\":" + std::to_string(population.plants) +
+                          ",\"step\":" + std::to_string(simulation.step_count()) + "}";
             }
-            
-            entity_grid[row][col].type = plant;
-            entity_grid[row][col].age = 0; 
-        }
-        for(i = 0; i < (uint32_t)request_body["herbivores"]; i++){
-            static std::random_device rd;
-            static std::mt19937 gen(rd());
-            std::uniform_int_distribution<> dis(0, 14);
-            row = dis(gen);
-            col = dis(gen);
-
-            while(!entity_grid[row][col].type == empty){
-                row = dis(gen);
-                col = dis(gen);
+            // Every k-th frame if asked for, and always the final one
+            if (k == steps || (emit_every != 0 && simulation.step_count() % emit_every == 0)) {
+                frames += frames.size() > 1 ? ",{\"grid\":" : "{\"grid\":";
+                frame_writer_t::append(simulation.grid(), frames);
+                frames += ",\"step\":" + std::to_string(simulation.step_count()) + "}";
             }
-            
-            entity_grid[row][col].type = herbivore;
-            entity_grid[row][col].age = 0;
-            entity_grid[row][col].energy = 100; 
-        }
-        for(i = 0; i < (uint32_t)request_body["carnivores"]; i++){
-            static std::random_device rd;
-            static std::mt19937 gen(rd());
-            std::uniform_int_distribution<> dis(0, 14);
-            row = dis(gen);
-            col = dis(gen);
-
-            while(!entity_grid[row][col].type == empty){
-                row = dis(gen);
-                col = dis(gen);
+        }
+        std::string result = "{" + (include_counts ? "\"counts\":" + counts + "]," : std::string()) + "\"frames\":" + frames +
+                             "],\"step\":" + std::to_string(simulation.step_count()) + "}";
+        session->publish_frame();
+        lock.unlock();
+
+        write_json_text(req, res, std::move(result));
+        compress_response(req, res, options);
+        res.end(); });
+
+    // Endpoint returning the population statistics after the session's latest step. They are kept up to date
+    // by the steps themselves, so polling costs the same whatever the size of the grid and never waits for a step.
+    CROW_ROUTE(app, "/stats")
+        .methods("GET"_method)([&sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        uint64_t step;
+        uint64_t generation;
+        population_stats_t stats = session->stats(step, generation);
+        if (generation == 0) {
+        res.code = 404;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+
+        const char *species[NUM_SPECIES] = {"plants", "herbivores", "carnivores"};
+        nlohmann::json result;
+        result["step"] = step;
+        result["generation"] = generation;
+        result["total_energy"] = stats.total_energy();
+        for (size_t s = 0; s < NUM_SPECIES; s++) {
+            result[species[s]] = stats.count[s];
+            result["energy"][species[s]] = stats.energy[s];
+            result["age_histograms"][species[s]] = std::vector<int64_t>(stats.ages[s], stats.ages[s] + SPECIES_MAXIMUM_AGE[s] + 1);
+        }
+        write_body(req, res, result);
+        res.end(); });
+
+    // Endpoint returning the population and mean energy of each species over past steps, as points of the
+    // session's downsampled series: ?from=A&to=B limits the steps, ?resolution=R merges points until each covers
+    // at least R steps. Older steps are only kept at coarser resolutions.
+    CROW_ROUTE(app, "/stats/history")
+        .methods("GET"_method)([&sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        const char *from = req.url_params.get("from");
+        const char *to = req.url_params.get("to");
+        const char *resolution = req.url_params.get("resolution");
+        uint64_t generation;
+        std::vector<population_bucket_t> points = session->stats_history(
+            from == nullptr ? 0 : std::strtoull(from, nullptr, 10), to == nullptr ? UINT64_MAX : std::strtoull(to, nullptr, 10),
+            resolution == nullptr ? 1 : std::strtoull(resolution, nullptr, 10), generation);
+        if (generation == 0) {
+        res.code = 404;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+
+        // Each point: its first step, the number of steps it covers, and per species the mean, smallest and
+        // largest population and the mean energy of an individual
+        const char *species[NUM_SPECIES] = {"plants", "herbivores", "carnivores"};
+        nlohmann::json result;
+        result["generation"] = generation;
+        result["points"] = nlohmann::json::array();
+        for (const population_bucket_t &point : points) {
+            nlohmann::json entry;
+            entry["step"] = point.first_step;
+            entry["steps"] = point.steps;
+            for (size_t s = 0; s < NUM_SPECIES; s++) {
+                entry[species[s]] = {{"mean", (double)point.count_sum[s] / point.steps},
+                                     {"min", point.count_min[s]},
+                                     {"max", point.count_max[s]},
+                                     {"mean_energy", point.count_sum[s] == 0 ? 0.0 : (double)point.energy_sum[s] / point.count_sum[s]}};
             }
-            
-            entity_grid[row][col].type = carnivore;
-            entity_grid[row][col].age = 0;
-            entity_grid[row][col].energy = 100;
+            result["points"].push_back(std::move(entry));
+        }
+        write_body(req, res, result);
+        res.end(); });
+
+    // Endpoint reporting how the tiles of the session's last step were spread over the workers
+    CROW_ROUTE(app, "/worker-stats")
+        .methods("GET"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
         }
 
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        res.body = json_grid.dump();
+        std::lock_guard<std::mutex> lock(session->mutex);
+        nlohmann::json stats;
+        stats["scheduler"] = options.scheduler == work_stealing ? "work-stealing" : "static";
+        stats["workers"] = nlohmann::json::array();
+        for (const worker_stats_t &worker : session->worker_stats()) {
+            stats["workers"].push_back({{"busy_us", worker.busy_ns / 1000},
+                                        {"idle_us", worker.idle_ns / 1000},
+                                        {"tiles", worker.tasks},
+                                        {"stolen", worker.stolen}});
+        }
+        res.body = stats.dump();
         res.end(); });
 
-    // Endpoint to process HTTP GET requests for the next simulation iteration
-    CROW_ROUTE(app, "/next-iteration")
-        .methods("GET"_method)([]()
+    // Endpoint saving the session's world to a checkpoint file: {"name": "..."}, by default the session ID and step
+    CROW_ROUTE(app, "/checkpoint")
+        .methods("POST"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                                {
+        nlohmann::json request_body;
+        if (!read_body(req, res, request_body)) {
+            return;
+        }
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(session->mutex);
+        const simulation_t &simulation = session->simulation();
+        if (simulation.grid().empty()) {
+        res.code = 409;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+        if (!request_body.is_object() || (request_body.contains("name") && !request_body["name"].is_string())) {
+        res.code = 400;
+        res.body = "Invalid request body";
+        res.end();
+        return;
+        }
+        std::string name = request_body.value("name", session->id() + "-" + std::to_string(simulation.step_count()));
+        if (!valid_file_name(name)) {
+        res.code = 400;
+        res.body = "Invalid checkpoint name";
+        res.end();
+        return;
+        }
+
+        ::mkdir(options.checkpoint_dir.c_str(), 0755);
+        std::string error = save_checkpoint(options.checkpoint_dir + "/" + name + CHECKPOINT_EXTENSION, simulation);
+        if (!error.empty()) {
+        res.code = 500;
+        res.body = error;
+        res.end();
+        return;
+        }
+
+        nlohmann::json result;
+        result["name"] = name;
+        result["step"] = simulation.step_count();
+        result["bytes"] = sizeof(checkpoint_header_t) + simulation.grid().size() * sizeof(entity_t);
+        lock.unlock();
+
+        write_body(req, res, result);
+        res.end(); });
+
+    // Endpoint resuming a checkpoint: {"name": "..."}. Like /start-simulation, it creates a new session unless
+    // ?session=ID names one to restore into, and returns the restored grid.
+    CROW_ROUTE(app, "/restore")
+        .methods("POST"_method)([&options, &sessions, &session_settings](crow::request &req, crow::response &res)
+                                {
+        nlohmann::json request_body;
+        if (!read_body(req, res, request_body)) {
+            return;
+        }
+        if (!request_body.is_object() || (request_body.contains("name") && !request_body["name"].is_string()) ||
+            (request_body.contains("record") && !request_body["record"].is_boolean())) {
+        res.code = 400;
+        res.body = "Invalid request body";
+        res.end();
+        return;
+        }
+        std::string name = request_body.value("name", "");
+        if (!valid_file_name(name)) {
+        res.code = 400;
+        res.body = "Invalid checkpoint name";
+        res.end();
+        return;
+        }
+
+        simulation_params_t params;
+        uint64_t step = 0;
+        grid_t<entity_t> grid;
+        checkpoint_status_t status = load_checkpoint(options.checkpoint_dir + "/" + name + CHECKPOINT_EXTENSION, params, step, grid);
+        if (status != checkpoint_loaded) {
+        res.code = status == checkpoint_unknown ? 404 : status == checkpoint_unmapped ? 500 : 400;
+        res.body = checkpoint_status_message(status);
+        res.end();
+        return;
+        }
+
+        std::shared_ptr<session_t> session;
+        if (req.url_params.get("session") != nullptr && !(session = find_session(sessions, req, res))) {
+            return;
+        }
+        if (!sessions.make_room(session_t::estimate_memory(params, session_settings), session.get())) {
+        res.code = 503;
+        res.body = "Memory budget exceeded";
+        res.end();
+        return;
+        }
+        if (!session) {
+            session = sessions.create();
+        }
+
+        std::unique_lock<std::mutex> lock(session->mutex);
+        session->restore(params, step, std::move(grid));
+        std::string record_error = request_body.value("record", false) ? start_recording(*session, options) : "";
+        std::shared_ptr<const frame_t> frame = session->publish_frame();
+        lock.unlock();
+        if (!record_error.empty()) {
+        res.code = 500;
+        res.body = record_error;
+        res.end();
+        return;
+        }
+
+        res.set_header("X-Session-Id", session->id());
+        if (request_body.value("record", false)) {
+            res.set_header("X-Run-Id", session->run_name());
+        }
+        res.set_header("X-Simulation-Seed", std::to_string(params.seed));
+        serve_frame(req, res, options, *frame, "grid", false, [&]() { return frame->body; });
+        res.end(); });
+
+    // Endpoint recording every following step of the session's run, until the session is restarted or removed
+    CROW_ROUTE(app, "/record")
+        .methods("POST"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                                {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(session->mutex);
+        if (session->simulation().grid().empty()) {
+        res.code = 409;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+        std::string error = start_recording(*session, options);
+        if (!error.empty()) {
+        res.code = 500;
+        res.body = error;
+        res.end();
+        return;
+        }
+        nlohmann::json result;
+        result["run"] = session->run_name();
+        result["step"] = session->simulation().step_count();
+        lock.unlock();
+
+        write_body(req, res, result);
+        res.end(); });
+
+    // Endpoint rebuilding one step of a recorded run from its nearest keyframe. Recorded steps never change,
+    // so responses may be cached for good.
+    CROW_ROUTE(app, "/replay/<string>/<uint>")
+        .methods("GET"_method)([&options](crow::request &req, crow::response &res, const std::string &run, uint64_t step)
+                               {
+        if (!valid_file_name(run)) {
+        res.code = 404;
+        res.body = "Unknown run";
+        res.end();
+        return;
+        }
+
+        grid_t<entity_t> grid;
+        replay_status_t status = replay_step(options.record_dir + "/" + run + RUN_FILE_EXTENSION,
+                                             options.record_dir + "/" + run + RUN_INDEX_EXTENSION, step, grid);
+        if (status != replay_rebuilt) {
+        res.code = status == replay_invalid_index || status == replay_invalid_record ? 500 : 404;
+        res.body = replay_status_message(status);
+        res.end();
+        return;
+        }
+
+        frame_writer_t writer;
+        res.set_header("Content-Type", "application/json");
+        res.set_header("X-Simulation-Step", std::to_string(step));
+        res.set_header("Cache-Control", "public, max-age=31536000, immutable");
+        res.body = writer.write(grid);
+        compress_response(req, res, options);
+        res.end(); });
+
+    // Endpoint listing the sessions with the memory each holds, against the budget
+    CROW_ROUTE(app, "/sessions")
+        .methods("GET"_method)([&sessions]()
+                               {
+        nlohmann::json result;
+        result["memory_budget"] = sessions.memory_budget();
+        result["sessions"] = nlohmann::json::array();
+        size_t total = 0;
+        for (const std::shared_ptr<session_t> &session : sessions.list()) {
+            size_t memory = session->memory_usage();
+            total += memory;
+            std::shared_ptr<const frame_t> frame = session->latest_frame();
+            result["sessions"].push_back({{"id", session->id()},
+                                         {"memory_usage", memory},
+                                         {"idle_seconds", std::chrono::duration_cast<std::chrono::seconds>(session->idle_time()).count()},
+                                         {"viewers", session->num_subscribers()},
+                                         {"step", frame ? frame->step : 0}});
+        }
+        result["memory_usage"] = total;
+        return result.dump(); });
+
+    // Endpoint removing a session, which stops its loop, disconnects its viewers and releases its memory
+    CROW_ROUTE(app, "/sessions/<string>")
+        .methods("DELETE"_method)([&sessions](crow::request &, crow::response &res, const std::string &id)
+                                  {
+        if (!sessions.remove(id)) {
+        res.code = 404;
+        res.body = "Unknown session";
+        res.end();
+        return;
+        }
+
+        res.code = 204;
+        res.end(); });
+
+    // Whether the session's loop runs, at which rate, and the step of its latest frame
+    auto loop_status = [](session_t &session)
+    {
+        std::shared_ptr<const frame_t> frame = session.latest_frame();
+        nlohmann::json status;
+        status["running"] = session.loop().running();
+        status["ticks_per_second"] = session.loop().tick_rate();
+        status["step"] = frame ? frame->step : 0;
+        return status.dump();
+    };
+
+    // Tick rates a request may set: 0, for as fast as possible, or a finite rate no slower than the loop's minimum
+    auto valid_tick_rate = [](const nlohmann::json &rate)
+    {
+        return rate.is_number() && (rate.get<double>() == 0 ||
+                                    (std::isfinite(rate.get<double>()) && rate.get<double>() >= simulation_loop_t::MINIMUM_TICK_RATE));
+    };
+
+    // Endpoint to start the loop, optionally with a tick rate: {"ticks_per_second": R}
+    CROW_ROUTE(app, "/loop/start")
+        .methods("POST"_method)([&sessions, &loop_status, &valid_tick_rate](crow::request &req, crow::response &res)
+                                {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        nlohmann::json request_body;
+        if (!read_body(req, res, request_body)) {
+            return;
+        }
+        if (!request_body.is_object() ||
+            (request_body.contains("ticks_per_second") && !valid_tick_rate(request_body["ticks_per_second"]))) {
+        res.code = 400;
+        res.body = "Invalid tick rate";
+        res.end();
+        return;
+        }
+        double ticks_per_second = request_body.value("ticks_per_second", session->loop().tick_rate());
+        if (!session->latest_frame()) {
+        res.code = 409;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+
+        session->loop().set_tick_rate(ticks_per_second);
+        session->loop().resume();
+        res.body = loop_status(*session);
+        res.end(); });
+
+    // Endpoint to stop the loop after the step in progress, if any
+    CROW_ROUTE(app, "/loop/pause")
+        .methods("POST"_method)([&sessions, &loop_status](crow::request &req, crow::response &res)
+                                {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+
+        session->loop().pause();
+        res.body = loop_status(*session);
+        res.end(); });
+
+    // Endpoint to continue a paused loop at its current tick rate
+    CROW_ROUTE(app, "/loop/resume")
+        .methods("POST"_method)([&sessions, &loop_status](crow::request &req, crow::response &res)
+                                {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        if (!session->latest_frame()) {
+        res.code = 409;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+
+        session->loop().resume();
+        res.body = loop_status(*session);
+        res.end(); });
+
+    // Endpoint to change the tick rate, running or not: {"ticks_per_second": R}, 0 runs as fast as possible
+    CROW_ROUTE(app, "/loop/tick-rate")
+        .methods("POST"_method)([&sessions, &loop_status, &valid_tick_rate](crow::request &req, crow::response &res)
+                                {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        nlohmann::json request_body;
+        if (!read_body(req, res, request_body)) {
+            return;
+        }
+        if (!request_body.is_object() || !request_body.contains("ticks_per_second") || !valid_tick_rate(request_body["ticks_per_second"])) {
+        res.code = 400;
+        res.body = "Invalid tick rate";
+        res.end();
+        return;
+        }
+
+        session->loop().set_tick_rate(request_body["ticks_per_second"].get<double>());
+        res.body = loop_status(*session);
+        res.end(); });
+
+    // Endpoint reporting whether the loop runs, at which rate, and the step of the latest frame
+    CROW_ROUTE(app, "/loop")
+        .methods("GET"_method)([&sessions, &loop_status](crow::request &req, crow::response &res)
                                {
-        // Simulate the next iteration
-        // Iterate over the entity grid and simulate the behaviour of each entity
-        
-        int i, j;
-        pos_t valid_position;
-        pos_t chose_position;
-        pos_t current_pos;
-        std::vector<std::thread> threads;
-
-        for (i = 0; i < NUM_ROWS; i++){
-            for (j = 0; j < NUM_ROWS; j++){
-                current_pos.i = i;
-                current_pos.j = j;
-                if(check_cell(current_pos, already_atualized_pos)){
-                    if(entity_grid[i][j].type != empty){
-                        if(entity_grid[i][j].type == plant){
-                            std::thread t_plant(simulate_plant,current_pos);
-                            threads.push_back(std::move(t_plant));
-                        } else if(entity_grid[i][j].type == herbivore){
-                            // std::thread t_herb(simulate_herb,current_pos);
-                            // threads.push_back(std::move(t_herb));
-                        } else if(entity_grid[i][j].type == carnivore){
-                            // std::thread t_carn(simulate_carn,current_pos);
-                            // threads.push_back(std::move(t_carn));
-                        }
-                    }
-                }
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+
+        res.body = loop_status(*session);
+        res.end(); });
+
+    // Endpoint returning the latest published frame, without waiting for the step in progress.
+    // With ?since=N (and &generation=G) it returns the cells changed since frame N, or a keyframe.
+    CROW_ROUTE(app, "/frame")
+        .methods("GET"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        std::vector<std::shared_ptr<const frame_delta_t>> chain;
+        bool has_delta = false;
+        const char *since = req.url_params.get("since");
+        const char *generation = req.url_params.get("generation");
+        uint64_t from = since == nullptr ? 0 : std::strtoull(since, nullptr, 10);
+        std::shared_ptr<const frame_t> frame = session->latest_frame_since(from, chain, has_delta);
+        if (!frame) {
+        res.code = 404;
+        res.body = "No simulation started";
+        res.end();
+        return;
+        }
+
+        if (since == nullptr) {
+            serve_frame(req, res, options, *frame, "grid", false, [&]() { return frame->body; });
+            res.end();
+            return;
+        }
+
+        // A delta from the client's frame, or a keyframe if that frame is unknown, belongs to another generation
+        // or the delta would not be smaller. Clients at the same step share the delta; clients too far behind share the keyframe.
+        // The chain is merged, and the choice made, once per frame and starting step: the choice is cached next to
+        // the frame's representations, and the merge only redone by a request that builds a representation of the delta.
+        has_delta = has_delta && (generation == nullptr || std::strtoull(generation, nullptr, 10) == frame->generation);
+        std::vector<cell_change_t> changes;
+        bool merged = false;
+        auto merge = [&]()
+        {
+            if (!merged) {
+                merge_deltas(chain, changes);
+                merged = true;
             }
+        };
+        const std::string variant = "since" + std::to_string(from);
+        if (has_delta && frame->representations.get(variant + "-choice", [&]()
+                                                    { merge();
+                                                      representation_t choice;
+                                                      choice.body = changes.size() * 2 <= frame->num_cells ? "delta" : "keyframe";
+                                                      return choice; })->body == "delta") {
+            serve_frame(req, res, options, *frame, variant, false, [&]()
+                        { merge();
+                          return delta_message(frame->generation, from, frame->step, changes).dump(); });
+        } else {
+            serve_frame(req, res, options, *frame, "keyframe", false, [&]() { return keyframe_message(*frame); });
+        }
+        res.end(); });
+
+    // Endpoint returning the latest published frame in the packed binary format of binary_frame.h
+    CROW_ROUTE(app, "/frame.bin")
+        .methods("GET"_method)([&options, &sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
         }
-        for(auto& it : threads){
-            it.join();
+        std::shared_ptr<const frame_t> frame = session->latest_frame();
+        if (!frame) {
+        res.code = 404;
+        res.body = "No simulation started";
+        res.end();
+        return;
         }
-        already_atualized_pos.clear();
-        // Return the JSON representation of the entity grid
-        nlohmann::json json_grid = entity_grid; 
-        return json_grid.dump(); });
-    app.port(8080).run();
+
+        serve_frame(req, res, options, *frame, "binary", true, [&]() { return frame->binary; });
+        res.end(); });
+
+    // Endpoint returning a past step of the session, rebuilt from the history it keeps in memory.
+    // A step of a given generation never changes, so with ?generation=G the response may be cached for good.
+    CROW_ROUTE(app, "/frame/<uint>")
+        .methods("GET"_method)([&options, &sessions](crow::request &req, crow::response &res, uint64_t step)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        const char *generation = req.url_params.get("generation");
+        frame_t frame;
+        uint64_t first_step;
+        uint64_t last_step;
+        grid_t<entity_t> grid;
+        bool found = session->history().window(frame.generation, first_step, last_step);
+        if (generation != nullptr) {
+            frame.generation = std::strtoull(generation, nullptr, 10);
+        }
+        if (!found || !session->history().rebuild(frame.generation, step, grid)) {
+        res.code = 404;
+        res.body = "Step not in history";
+        res.end();
+        return;
+        }
+
+        frame.step = step;
+        frame.num_cells = grid.size();
+        res.set_header("Cache-Control", generation != nullptr ? "public, max-age=31536000, immutable" : "no-cache");
+        serve_frame(req, res, options, frame, "grid", false, [&]()
+                    { frame_writer_t writer;
+                      return writer.write(grid); });
+        res.end(); });
+
+    // Endpoint reporting the generation and the oldest and newest step GET /frame/<step> can serve
+    CROW_ROUTE(app, "/history")
+        .methods("GET"_method)([&sessions](crow::request &req, crow::response &res)
+                               {
+        std::shared_ptr<session_t> session = find_session(sessions, req, res);
+        if (!session) {
+            return;
+        }
+        uint64_t generation;
+        uint64_t first_step;
+        uint64_t last_step;
+        if (!session->history().window(generation, first_step, last_step)) {
+        res.code = 404;
+        res.body = "No history";
+        res.end();
+        return;
+        }
+
+        nlohmann::json result;
+        result["generation"] = generation;
+        result["first_step"] = first_step;
+        result["last_step"] = last_step;
+        result["memory_usage"] = session->history().memory_usage();
+        write_body(req, res, result);
+        res.end(); });
+
+    // Session a /ws connection is being opened for. Crow calls the open handler right after the accept
+    // handler, on the same thread, so the accept handler hands the session over through this variable.
+    static thread_local std::shared_ptr<session_t> accepted_session;
+
+    // WebSocket pushing the session's latest frame to the viewer as a binary keyframe, then every following frame as a JSON delta
+    CROW_ROUTE(app, "/ws")
+        .websocket()
+        .onaccept([&sessions](const crow::request &req)
+                  {
+        const char *id = req.url_params.get("session");
+        accepted_session = sessions.find(id == nullptr ? "" : id);
+        return accepted_session != nullptr; })
+        .onopen([](crow::websocket::connection &connection)
+                {
+        // The connection keeps only a weak reference, so it does not keep a removed session alive
+        connection.userdata(new std::weak_ptr<session_t>(accepted_session));
+        accepted_session->subscribe(&connection);
+        accepted_session.reset(); })
+        .onclose([](crow::websocket::connection &connection, const std::string &)
+                 {
+        auto *session_reference = static_cast<std::weak_ptr<session_t> *>(connection.userdata());
+        std::shared_ptr<session_t> session = session_reference->lock();
+        if (session) {
+            session->unsubscribe(&connection);
+        }
+        delete session_reference; });
+
+    app.port(options.port).run();
 
     return 0;
-}
\ No newline at end of file
+}
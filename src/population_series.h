@@ -0,0 +1,135 @@
+#pragma once
+
+#include "population_stats.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Steps summarised by one point of a population series
+struct population_bucket_t
+{
+    uint64_t first_step = 0;
+    uint64_t steps = 0;
+    // Per species: sum over the steps of the count and of the energy, and the smallest and largest count
+    int64_t count_sum[NUM_SPECIES] = {};
+    int64_t energy_sum[NUM_SPECIES] = {};
+    int64_t count_min[NUM_SPECIES] = {};
+    int64_t count_max[NUM_SPECIES] = {};
+
+    // Bucket of the single step step
+    static population_bucket_t sample(uint64_t step, const population_stats_t &stats)
+    {
+        population_bucket_t bucket;
+        bucket.first_step = step;
+        bucket.steps = 1;
+        for (size_t s = 0; s < NUM_SPECIES; s++)
+        {
+            bucket.count_sum[s] = stats.count[s];
+            bucket.energy_sum[s] = stats.energy[s];
+            bucket.count_min[s] = stats.count[s];
+            bucket.count_max[s] = stats.count[s];
+        }
+        return bucket;
+    }
+
+    // Extend the bucket with the steps of next, which follow its own
+    void merge(const population_bucket_t &next)
+    {
+        steps += next.steps;
+        for (size_t s = 0; s < NUM_SPECIES; s++)
+        {
+            count_sum[s] += next.count_sum[s];
+            energy_sum[s] += next.energy_sum[s];
+            count_min[s] = std::min(count_min[s], next.count_min[s]);
+            count_max[s] = std::max(count_max[s], next.count_max[s]);
+        }
+    }
+
+    uint64_t last_step() const { return first_step + steps - 1; }
+};
+
+// Population of each species and its energy, step after step, in a fixed amount of memory.
+// Level 0 keeps one bucket per step. When a level holds LEVEL_SIZE buckets, its two oldest are merged into one
+// bucket of the next level, so each level has half the resolution of the one before and covers older steps.
+// The last level drops its oldest bucket instead. LEVEL_SIZE buckets on each of NUM_LEVELS levels cover
+// LEVEL_SIZE * (2^NUM_LEVELS - 1) steps, over 60 million, in under 200 KB; a million steps fill 14 levels.
+class population_series_t
+{
+public:
+    static const size_t LEVEL_SIZE = 64;
+    static const size_t NUM_LEVELS = 20;
+
+    // Start again, empty
+    void clear()
+    {
+        for (std::deque<population_bucket_t> &level : levels_)
+        {
+            level.clear();
+        }
+    }
+
+    // Add the statistics of the step following the last one added
+    void append(uint64_t step, const population_stats_t &stats)
+    {
+        population_bucket_t bucket = population_bucket_t::sample(step, stats);
+        for (size_t level = 0; level < NUM_LEVELS; level++)
+        {
+            levels_[level].push_back(bucket);
+            if (levels_[level].size() <= LEVEL_SIZE)
+            {
+                return;
+            }
+            if (level + 1 == NUM_LEVELS)
+            {
+                levels_[level].pop_front();
+                return;
+            }
+            bucket = levels_[level][0];
+            bucket.merge(levels_[level][1]);
+            levels_[level].pop_front();
+            levels_[level].pop_front();
+        }
+    }
+
+    // Buckets overlapping steps [from, to], oldest first. Consecutive buckets are merged until each spans at
+    // least resolution steps, except possibly the newest.
+    std::vector<population_bucket_t> query(uint64_t from, uint64_t to, uint64_t resolution) const
+    {
+        std::vector<population_bucket_t> result;
+        for (size_t level = NUM_LEVELS; level-- > 0;)
+        {
+            for (const population_bucket_t &bucket : levels_[level])
+            {
+                if (bucket.last_step() < from || bucket.first_step > to)
+                {
+                    continue;
+                }
+                if (!result.empty() && result.back().steps < resolution)
+                {
+                    result.back().merge(bucket);
+                }
+                else
+                {
+                    result.push_back(bucket);
+                }
+            }
+        }
+        return result;
+    }
+
+    size_t memory_usage() const
+    {
+        size_t buckets = 0;
+        for (const std::deque<population_bucket_t> &level : levels_)
+        {
+            buckets += level.size();
+        }
+        return buckets * sizeof(population_bucket_t);
+    }
+
+private:
+    std::deque<population_bucket_t> levels_[NUM_LEVELS];
+};
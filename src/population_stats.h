@@ -0,0 +1,90 @@
+#pragma once
+
+#include "entity.h"
+#include "grid.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+// Species counted by the population statistics, in entity_type_t order from plant
+const size_t NUM_SPECIES = 3;
+// Ages are counted one bucket per age up to the oldest a species lives to. Older cells, which only a
+// hand-made checkpoint can hold, fall into the last bucket of their species.
+const uint32_t SPECIES_MAXIMUM_AGE[NUM_SPECIES] = {PLANT_MAXIMUM_AGE, HERBIVORE_MAXIMUM_AGE, CARNIVORE_MAXIMUM_AGE};
+const size_t AGE_HISTOGRAM_BUCKETS = CARNIVORE_MAXIMUM_AGE + 1;
+
+// Number of entities of each species in a grid
+struct population_t
+{
+    uint64_t plants = 0;
+    uint64_t herbivores = 0;
+    uint64_t carnivores = 0;
+};
+
+// Entities of each species, their energy and how many there are of each age.
+// The fields are signed so the same type holds both the totals of a grid and the change one step makes to them.
+struct population_stats_t
+{
+    int64_t count[NUM_SPECIES] = {};
+    int64_t energy[NUM_SPECIES] = {};
+    int64_t ages[NUM_SPECIES][AGE_HISTOGRAM_BUCKETS] = {};
+
+    void add(const entity_t &cell) { tally(cell, 1); }
+    void remove(const entity_t &cell) { tally(cell, -1); }
+
+    // A cell changed from before to after
+    void replace(const entity_t &before, const entity_t &after)
+    {
+        tally(before, -1);
+        tally(after, 1);
+    }
+
+    void merge(const population_stats_t &other)
+    {
+        for (size_t s = 0; s < NUM_SPECIES; s++)
+        {
+            count[s] += other.count[s];
+            energy[s] += other.energy[s];
+            for (size_t a = 0; a < AGE_HISTOGRAM_BUCKETS; a++)
+            {
+                ages[s][a] += other.ages[s][a];
+            }
+        }
+    }
+
+    int64_t total_energy() const { return energy[0] + energy[1] + energy[2]; }
+
+    population_t population() const
+    {
+        population_t population;
+        population.plants = count[plant - plant];
+        population.herbivores = count[herbivore - plant];
+        population.carnivores = count[carnivore - plant];
+        return population;
+    }
+
+private:
+    void tally(const entity_t &cell, int64_t sign)
+    {
+        if (cell.type == empty)
+        {
+            return;
+        }
+        const size_t s = cell.type - plant;
+        count[s] += sign;
+        energy[s] += sign * cell.energy;
+        ages[s][std::min<uint32_t>(std::max(cell.age, 0), SPECIES_MAXIMUM_AGE[s])] += sign;
+    }
+};
+
+// Statistics of a whole grid, read cell by cell. Only used when a world starts; steps keep them up to date.
+inline population_stats_t measure_population(const grid_t<entity_t> &grid)
+{
+    population_stats_t stats;
+    for (const entity_t &cell : grid)
+    {
+        stats.add(cell);
+    }
+    return stats;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// A response body in one format and content encoding
+struct representation_t
+{
+    std::string body;
+    std::string content_type;
+    std::string content_encoding; // empty when the body is not compressed
+};
+
+// Every representation of one immutable frame served so far, keyed by variant. Each one is built once,
+// by the first reader that asks for it, and then handed to every other reader as the same shared buffer,
+// so the cost of serving a frame does not grow with the number of viewers.
+class representation_cache_t
+{
+public:
+    std::shared_ptr<const representation_t> get(const std::string &key, const std::function<representation_t()> &build) const
+    {
+        // Readers of the same frame wait for the one building, rather than building it again
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = representations_.find(key);
+        if (found != representations_.end())
+        {
+            return found->second;
+        }
+        auto representation = std::make_shared<const representation_t>(build());
+        representations_.emplace(key, representation);
+        return representation;
+    }
+
+    // Bytes held by the bodies built so far
+    size_t memory_usage() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t bytes = 0;
+        for (const auto &entry : representations_)
+        {
+            bytes += entry.second->body.capacity();
+        }
+        return bytes;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    mutable std::map<std::string, std::shared_ptr<const representation_t>> representations_;
+};
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "binary_frame.h"
+#include "entity.h"
+#include "file_name.h"
+#include "frame_delta.h"
+#include "grid.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Recorded run, in two append-only files, integers little-endian.
+//
+// Run file: a 16-byte header, then one record per step in step order.
+//   header: magic "ECORUN\0\0", version u32, keyframe interval u32
+//   record: kind u8 (0 keyframe, 1 delta), step u64, payload size u32, payload
+//     keyframe: the whole grid as a binary frame (binary_frame.h)
+//     delta:    varint number of changed cells, then for each, in index order, the varint number of cells
+//               skipped since the previous one, followed by its type, age and energy bytes
+// Index file: one 16-byte entry per keyframe, its step u64 and the offset u64 of its record in the run file.
+//
+// A keyframe is written every keyframe interval steps, and whenever it would be no larger than the delta. To rebuild a step, a reader binary-searches the index for the last keyframe at or before it and
+// applies the deltas that follow, so no step costs more than one keyframe and interval - 1 deltas to decode.
+// A run cut short by a crash loses at most its last record, which readers ignore if it is incomplete.
+const char RUN_FILE_MAGIC[] = "ECORUN\0";
+const uint32_t RUN_FILE_VERSION = 1;
+const size_t RUN_FILE_HEADER_SIZE = 16;
+const size_t RUN_RECORD_HEADER_SIZE = 13;
+const size_t RUN_INDEX_ENTRY_SIZE = 16;
+const uint32_t DEFAULT_KEYFRAME_INTERVAL = 64;
+const char RUN_FILE_EXTENSION[] = ".run";
+const char RUN_INDEX_EXTENSION[] = ".idx";
+
+enum run_record_kind_t : uint8_t
+{
+    keyframe_record = 0,
+    delta_record = 1
+};
+
+// Payload of a delta record: the changes of one step, in index order
+inline void encode_delta_payload(const std::vector<cell_change_t> &changes, std::string &out)
+{
+    out.clear();
+    put_varint(out, changes.size());
+    uint64_t next = 0;
+    for (const cell_change_t &change : changes)
+    {
+        put_varint(out, change.index - next);
+        put_cell(out, change.cell);
+        next = change.index + 1;
+    }
+}
+
+// Apply the payload of a delta record to grid. Returns false if it is malformed.
+inline bool apply_delta_payload(const std::string &payload, grid_t<entity_t> &grid)
+{
+    size_t offset = 0;
+    uint64_t count;
+    if (!get_varint(payload.data(), payload.size(), offset, count))
+    {
+        return false;
+    }
+    uint64_t idx = 0;
+    for (uint64_t k = 0; k < count; k++)
+    {
+        uint64_t gap;
+        if (!get_varint(payload.data(), payload.size(), offset, gap) || offset + RUN_LENGTH_CELL_SIZE > payload.size() ||
+            gap >= grid.size() - idx)
+        {
+            return false;
+        }
+        idx += gap;
+        grid[idx++] = get_cell(payload.data() + offset);
+        offset += RUN_LENGTH_CELL_SIZE;
+    }
+    return true;
+}
+
+// Whether to store a step as a keyframe rather than as the delta already encoded in delta_payload: every
+// keyframe_interval steps, and whenever the keyframe of the grid, num_cells cells holding population entities,
+// would be no larger than the delta. The keyframe size is estimated from the counts, so the grid is not read.
+inline bool prefer_keyframe(size_t num_cells, uint64_t population, uint64_t steps_since_keyframe, uint32_t keyframe_interval,
+                            const std::string &delta_payload)
+{
+    return steps_since_keyframe >= keyframe_interval || delta_payload.size() >= estimate_binary_frame_size(num_cells, population);
+}
+
+// Appends every step of one run to its run and index files
+class run_recorder_t
+{
+public:
+    run_recorder_t() = default;
+    run_recorder_t(const run_recorder_t &) = delete;
+    run_recorder_t &operator=(const run_recorder_t &) = delete;
+
+    ~run_recorder_t()
+    {
+        close();
+    }
+
+    // Create the files and record grid, the world at step, as the first keyframe.
+    // Returns an error message, or an empty string on success.
+    std::string open(const std::string &run_path, const std::string &index_path, uint32_t keyframe_interval,
+                     const grid_t<entity_t> &grid, uint64_t step, uint64_t generation)
+    {
+        close();
+        run_ = std::fopen(run_path.c_str(), "wb");
+        index_ = std::fopen(index_path.c_str(), "wb");
+        if (run_ == nullptr || index_ == nullptr)
+        {
+            close();
+            return "Cannot create run files";
+        }
+        keyframe_interval_ = std::max<uint32_t>(1, keyframe_interval);
+        generation_ = generation;
+        std::string header(RUN_FILE_MAGIC, 8);
+        put_le(header, RUN_FILE_VERSION, 4);
+        put_le(header, keyframe_interval_, 4);
+        offset_ = 0;
+        if (!write(run_, header) || !write_keyframe(grid, step))
+        {
+            close();
+            return "Cannot write run files";
+        }
+        return "";
+    }
+
+    bool recording() const { return run_ != nullptr; }
+
+    // Record grid, the world after step, holding population entities, given the cells that changed since the
+    // previous step as a delta payload. Stops recording, and returns false, if the files cannot be written.
+    bool append(const grid_t<entity_t> &grid, uint64_t step, uint64_t population, const std::string &delta_payload)
+    {
+        if (!recording())
+        {
+            return false;
+        }
+        bool written = prefer_keyframe(grid.size(), population, step - last_keyframe_step_, keyframe_interval_, delta_payload)
+                           ? write_keyframe(grid, step)
+                           : write_record(delta_record, step, delta_payload);
+        if (!written)
+        {
+            close();
+        }
+        return written;
+    }
+
+    void close()
+    {
+        if (run_ != nullptr)
+        {
+            std::fclose(run_);
+        }
+        if (index_ != nullptr)
+        {
+            std::fclose(index_);
+        }
+        run_ = nullptr;
+        index_ = nullptr;
+        std::string().swap(payload_);
+    }
+
+    size_t memory_usage() const { return payload_.capacity(); }
+
+private:
+    static bool write(std::FILE *file, const std::string &bytes)
+    {
+        return std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    }
+
+    // Append one record, flushed so that readers see it
+    bool write_record(run_record_kind_t kind, uint64_t step, const std::string &payload)
+    {
+        std::string header;
+        put_le(header, kind, 1);
+        put_le(header, step, 8);
+        put_le(header, payload.size(), 4);
+        bool written = write(run_, header) && write(run_, payload) && std::fflush(run_) == 0;
+        offset_ += header.size() + payload.size();
+        return written;
+    }
+
+    bool write_keyframe(const grid_t<entity_t> &grid, uint64_t step)
+    {
+        const uint64_t offset = RUN_FILE_HEADER_SIZE + offset_;
+        payload_ = encode_binary_frame(grid, step, generation_);
+        if (!write_record(keyframe_record, step, payload_))
+        {
+            return false;
+        }
+        // The index entry goes last, so it never points past the end of the run file
+        std::string entry;
+        put_le(entry, step, 8);
+        put_le(entry, offset, 8);
+        if (!write(index_, entry) || std::fflush(index_) != 0)
+        {
+            return false;
+        }
+        last_keyframe_step_ = step;
+        return true;
+    }
+
+    std::FILE *run_ = nullptr;
+    std::FILE *index_ = nullptr;
+    // Bytes written to the run file after its header
+    uint64_t offset_ = 0;
+    uint32_t keyframe_interval_ = DEFAULT_KEYFRAME_INTERVAL;
+    uint64_t generation_ = 0;
+    uint64_t last_keyframe_step_ = 0;
+    std::string payload_;
+};
+
+// Outcome of replay_step
+enum replay_status_t
+{
+    replay_rebuilt,
+    replay_unknown_run,      // there are no such files
+    replay_step_not_recorded,
+    replay_invalid_index,
+    replay_invalid_record
+};
+
+inline const char *replay_status_message(replay_status_t status)
+{
+    switch (status)
+    {
+    case replay_rebuilt:
+        return "";
+    case replay_unknown_run:
+        return "Unknown run";
+    case replay_step_not_recorded:
+        return "Step not recorded";
+    case replay_invalid_index:
+        return "Invalid run index";
+    default:
+        return "Invalid run record";
+    }
+}
+
+// Rebuild the world at step from the files of a recorded run
+inline replay_status_t replay_step(const std::string &run_path, const std::string &index_path, uint64_t step, grid_t<entity_t> &grid)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> index(std::fopen(index_path.c_str(), "rb"), std::fclose);
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> run(std::fopen(run_path.c_str(), "rb"), std::fclose);
+    if (!index || !run)
+    {
+        return replay_unknown_run;
+    }
+
+    // Last keyframe at or before step
+    std::fseek(index.get(), 0, SEEK_END);
+    const long num_entries = std::ftell(index.get()) / (long)RUN_INDEX_ENTRY_SIZE;
+    char entry[RUN_INDEX_ENTRY_SIZE];
+    auto read_entry = [&](long k)
+    {
+        std::fseek(index.get(), k * (long)RUN_INDEX_ENTRY_SIZE, SEEK_SET);
+        return std::fread(entry, 1, sizeof(entry), index.get()) == sizeof(entry);
+    };
+    long low = 0;
+    long high = num_entries;
+    while (low < high)
+    {
+        long middle = (low + high) / 2;
+        if (!read_entry(middle))
+        {
+            return replay_invalid_index;
+        }
+        if (get_le(entry, 8) <= step)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == 0)
+    {
+        return replay_step_not_recorded;
+    }
+    if (!read_entry(low - 1))
+    {
+        return replay_invalid_index;
+    }
+
+    // Decode forward from the keyframe
+    std::fseek(run.get(), (long)get_le(entry + 8, 8), SEEK_SET);
+    std::string payload;
+    bool decoded = false;
+    for (;;)
+    {
+        char header[RUN_RECORD_HEADER_SIZE];
+        if (std::fread(header, 1, sizeof(header), run.get()) != sizeof(header))
+        {
+            return replay_step_not_recorded;
+        }
+        const uint8_t kind = (uint8_t)header[0];
+        const uint64_t record_step = get_le(header + 1, 8);
+        payload.resize(get_le(header + 9, 4));
+        if (std::fread(&payload[0], 1, payload.size(), run.get()) != payload.size() || record_step > step)
+        {
+            return replay_step_not_recorded;
+        }
+        if (kind == keyframe_record)
+        {
+            uint64_t frame_step;
+            uint64_t generation;
+            if (!decode_binary_frame(payload.data(), payload.size(), grid, frame_step, generation))
+            {
+                return replay_invalid_record;
+            }
+            decoded = true;
+        }
+        else if (kind == delta_record && decoded)
+        {
+            if (!apply_delta_payload(payload, grid))
+            {
+                return replay_invalid_record;
+            }
+        }
+        else
+        {
+            return replay_invalid_record;
+        }
+        if (record_step == step)
+        {
+            return replay_rebuilt;
+        }
+    }
+}
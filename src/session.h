@@ -0,0 +1,696 @@
+#pragma once
+
+#include "crow_all.h"
+#include "binary_frame.h"
+#include "frame_delta.h"
+#include "frame_history.h"
+#include "frame_writer.h"
+#include "json.hpp"
+#include "population_series.h"
+#include "population_stats.h"
+#include "representation_cache.h"
+#include "run_recorder.h"
+#include "simulation.h"
+#include "simulation_loop.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+// A serialised grid together with the step it shows
+struct frame_t
+{
+    uint64_t generation = 0; // drawn anew by every start or restore of any session, so frames of different worlds are never mixed up
+    uint64_t step = 0;
+    uint64_t num_cells = 0;
+    std::string body;   // JSON array of rows
+    std::string binary; // binary frame, see binary_frame.h
+    // Every format and encoding of this frame requested so far, shared by all readers
+    representation_cache_t representations;
+};
+
+// Whole grid: {"generation": g, "grid": ..., "step": n, "type": "keyframe"}
+inline std::string keyframe_message(const frame_t &frame)
+{
+    return "{\"generation\":" + std::to_string(frame.generation) + ",\"grid\":" + frame.body +
+           ",\"step\":" + std::to_string(frame.step) + ",\"type\":\"keyframe\"}";
+}
+
+// Changed cells only: {"cells": [[index, type, age, energy], ...], "from": m, "generation": g, "step": n, "type": "delta"}
+inline nlohmann::json delta_message(uint64_t generation, uint64_t from, uint64_t step, const std::vector<cell_change_t> &changes)
+{
+    nlohmann::json message;
+    message["type"] = "delta";
+    message["generation"] = generation;
+    message["from"] = from;
+    message["step"] = step;
+    message["cells"] = changes;
+    return message;
+}
+
+// How every session of a server steps and remembers its worlds
+struct session_settings_t
+{
+    scheduling_policy_t policy = work_stealing;
+    // Memory cap of the step history served by GET /frame/<step>, 0 keeping none. Off by default: while it is on
+    // every step is diffed against a copy of the previous grid.
+    size_t history_memory = 0;
+    // At most this many steps between two keyframes of the history and of recorded runs
+    uint32_t keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+};
+
+// One independent world: its simulation, the frames published from it, its viewers and its loop.
+// Sessions share the worker pool but nothing else, so steps of different sessions may run side by side.
+class session_t
+{
+public:
+    // Number of deltas kept for clients catching up with GET /frame?since=N
+    static const size_t DELTA_HISTORY_LENGTH = 64;
+
+    // generations is the counter every session of the server draws its generations from
+    session_t(std::string id, thread_pool_t *pool, const session_settings_t &settings, std::atomic<uint64_t> *generations)
+        : id_(std::move(id)), generations_(generations), history_(settings.history_memory, settings.keyframe_interval), delta_history_(DELTA_HISTORY_LENGTH)
+    {
+        executor_.pool = pool;
+        executor_.policy = settings.policy;
+        executor_.stats = &worker_stats_;
+        touch();
+    }
+
+    session_t(const session_t &) = delete;
+    session_t &operator=(const session_t &) = delete;
+
+    const std::string &id() const { return id_; }
+
+    // Serialises requests that read or advance this session's simulation.
+    // start, step, publish_frame, simulation and worker_stats must be called with it held.
+    std::mutex mutex;
+
+    // (Re)start the world. What the previous world held is released, so a restart with a smaller grid shrinks the session.
+    void start(const simulation_params_t &params)
+    {
+        release_frame_buffers();
+        simulation_.start(params);
+        generation_ = ++*generations_;
+        track_steps();
+        publish_stats();
+    }
+
+    // Resume a checkpointed world, see checkpoint.h
+    void restore(const simulation_params_t &params, uint64_t step, grid_t<entity_t> &&grid)
+    {
+        release_frame_buffers();
+        simulation_.restore(params, step, std::move(grid));
+        generation_ = ++*generations_;
+        track_steps();
+        publish_stats();
+    }
+
+    // Bytes a session started with these parameters will hold once it has published its first frames:
+    // the grids and step scratch, the published copy, and the JSON text of the frame, plus the history
+    // at its cap, which it fills as it runs
+    static size_t estimate_memory(const simulation_params_t &params, const session_settings_t &settings)
+    {
+        const size_t num_cells = (size_t)params.height * params.width;
+        return num_cells * (4 * sizeof(entity_t) + ESTIMATED_JSON_BYTES_PER_CELL + 3) + num_cells / 8 + settings.history_memory;
+    }
+
+    // Simulate the next iteration, one checkerboard colour of tiles at a time
+    void step()
+    {
+        worker_stats_.assign(executor_.pool->size(), worker_stats_t());
+        simulation_.step(executor_);
+        // The recording, the history and the next published delta share one diff against the previous step
+        if (tracking_steps())
+        {
+            step_changes_.clear();
+            diff_grids(previous_step_grid_, simulation_.grid(), step_changes_);
+            for (const cell_change_t &change : step_changes_)
+            {
+                previous_step_grid_[change.index] = change.cell;
+            }
+            const population_t population = simulation_.stats().population();
+            encode_delta_payload(step_changes_, step_payload_);
+            recorder_.append(simulation_.grid(), simulation_.step_count(), population.plants + population.herbivores + population.carnivores,
+                             step_payload_);
+            history_.append(simulation_.grid(), simulation_.step_count(), population.plants + population.herbivores + population.carnivores,
+                            step_payload_);
+            if (unpublished_changes_valid_)
+            {
+                merge_changes(unpublished_changes_, step_changes_, merge_scratch_);
+                // A delta that large is not worth sending; the next frame goes out as a keyframe
+                if (unpublished_changes_.size() * 2 > simulation_.grid().size())
+                {
+                    unpublished_changes_valid_ = false;
+                    unpublished_changes_.clear();
+                }
+            }
+        }
+        else
+        {
+            unpublished_changes_valid_ = false;
+        }
+        publish_stats();
+    }
+
+    // Record every step of the current run from now on into directory, under the name run_name() then returns.
+    // The recording ends when the session is restarted or removed; asking again while it lasts changes nothing.
+    // Returns an error message, or an empty string on success.
+    std::string record(const std::string &directory, uint32_t keyframe_interval)
+    {
+        if (recorder_.recording())
+        {
+            return "";
+        }
+        run_name_ = id_ + "-" + std::to_string(generation_);
+        if (!history_.enabled())
+        {
+            previous_step_grid_ = simulation_.grid();
+        }
+        return recorder_.open(directory + "/" + run_name_ + RUN_FILE_EXTENSION, directory + "/" + run_name_ + RUN_INDEX_EXTENSION,
+                              keyframe_interval, simulation_.grid(), simulation_.step_count(), generation_);
+    }
+
+    const std::string &run_name() const { return run_name_; }
+
+    // Statistics of the current world after its latest step, which step that is and the generation (0 before the first start).
+    // They are copied out after every step, so reading them neither waits for a step nor reads the grid.
+    population_stats_t stats(uint64_t &step, uint64_t &generation) const
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        step = stats_step_;
+        generation = stats_generation_;
+        return stats_;
+    }
+
+    // Points of the statistics of the current world over steps [from, to], each covering at least resolution steps
+    // where the series still has them that fine, see population_series_t
+    std::vector<population_bucket_t> stats_history(uint64_t from, uint64_t to, uint64_t resolution, uint64_t &generation) const
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        generation = stats_generation_;
+        return series_.query(from, to, resolution);
+    }
+
+    // Recent steps of the current world, readable without the session mutex
+    const frame_history_t &history() const { return history_; }
+
+    const simulation_t &simulation() const { return simulation_; }
+    // Busy and idle time of each worker during the last step
+    const std::vector<worker_stats_t> &worker_stats() const { return worker_stats_; }
+
+    // Serialise the current grid, make it the latest frame and push it to the subscribers, as a delta
+    // against the previous frame unless the simulation was restarted in between.
+    // Sending only queues the message on each connection's I/O thread.
+    std::shared_ptr<const frame_t> publish_frame()
+    {
+        std::shared_ptr<const frame_t> previous = latest_frame();
+        if (previous && previous->generation == generation_ && previous->step == simulation_.step_count())
+        {
+            return previous;
+        }
+
+        auto frame = std::make_shared<frame_t>();
+        frame->generation = generation_;
+        frame->step = simulation_.step_count();
+        frame->num_cells = simulation_.grid().size();
+        frame->body = frame_writer_.write(simulation_.grid());
+        frame->binary = encode_binary_frame(simulation_.grid(), frame->step, frame->generation);
+
+        // The changes since the previous frame come from the steps when they were all diffed, and otherwise
+        // from diffing against a copy of the previous frame's grid
+        std::shared_ptr<frame_delta_t> delta;
+        if (previous && previous->generation == frame->generation &&
+            (unpublished_changes_valid_ || published_grid_.size() == simulation_.grid().size()))
+        {
+            delta = std::make_shared<frame_delta_t>();
+            delta->from = previous->step;
+            delta->to = frame->step;
+            if (unpublished_changes_valid_)
+            {
+                delta->changes = unpublished_changes_;
+            }
+            else
+            {
+                diff_grids(published_grid_, simulation_.grid(), delta->changes);
+            }
+        }
+        unpublished_changes_.clear();
+        unpublished_changes_valid_ = tracking_steps();
+        if (unpublished_changes_valid_)
+        {
+            published_grid_.clear();
+        }
+        else
+        {
+            published_grid_ = simulation_.grid();
+        }
+        state_memory_ = simulation_.memory_usage() + published_grid_.memory_usage() + recorder_.memory_usage() +
+                        previous_step_grid_.memory_usage() +
+                        (step_changes_.capacity() + unpublished_changes_.capacity() + merge_scratch_.capacity()) * sizeof(cell_change_t) +
+                        step_payload_.capacity() + frame->body.capacity() + frame->binary.capacity() + worker_stats_.capacity() * sizeof(worker_stats_t);
+
+        // Subscribers are locked first so that a viewer joining now gets either the previous frame and this
+        // message, or this frame and none of it
+        std::lock_guard<std::mutex> subscribers_lock(subscribers_mutex_);
+        {
+            std::lock_guard<std::mutex> lock(latest_frame_mutex_);
+            latest_frame_ = frame;
+            if (delta)
+            {
+                delta_history_.push(delta);
+            }
+            else
+            {
+                delta_history_.clear();
+            }
+            state_memory_ += delta_history_.memory_usage();
+        }
+
+        if (!subscribers_.empty())
+        {
+            std::string message = delta ? delta_message(frame->generation, delta->from, delta->to, delta->changes).dump() : frame->binary;
+            for (crow::websocket::connection *subscriber : subscribers_)
+            {
+                if (delta)
+                {
+                    subscriber->send_text(message);
+                }
+                else
+                {
+                    subscriber->send_binary(message);
+                }
+            }
+        }
+        return frame;
+    }
+
+    // Latest frame, replaced after every step. Readers take references to it and serve them without
+    // touching the session mutex, so they never hold up stepping.
+    std::shared_ptr<const frame_t> latest_frame() const
+    {
+        std::lock_guard<std::mutex> lock(latest_frame_mutex_);
+        return latest_frame_;
+    }
+
+    // Latest frame together with the deltas that lead to it from step `from`, if they are all still known
+    std::shared_ptr<const frame_t> latest_frame_since(uint64_t from, std::vector<std::shared_ptr<const frame_delta_t>> &chain,
+                                                      bool &has_delta) const
+    {
+        std::lock_guard<std::mutex> lock(latest_frame_mutex_);
+        has_delta = latest_frame_ && (from == latest_frame_->step || delta_history_.chain(from, chain));
+        return latest_frame_;
+    }
+
+    // Viewers connected to /ws, each sent a binary keyframe and then every delta as it is published
+    void subscribe(crow::websocket::connection *connection)
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+        subscribers_.insert(connection);
+        std::shared_ptr<const frame_t> frame = latest_frame();
+        if (frame)
+        {
+            connection->send_binary(frame->binary);
+        }
+    }
+
+    void unsubscribe(crow::websocket::connection *connection)
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+        subscribers_.erase(connection);
+    }
+
+    size_t num_subscribers() const
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+        return subscribers_.size();
+    }
+
+    // Stop the loop and disconnect the viewers of a session that is being removed
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(loop_mutex_);
+            if (loop_)
+            {
+                loop_->pause();
+            }
+        }
+        std::lock_guard<std::mutex> lock(subscribers_mutex_);
+        for (crow::websocket::connection *subscriber : subscribers_)
+        {
+            subscriber->close("Session removed");
+        }
+    }
+
+    // Bytes held by the session, as of its latest frame, plus every representation served of that frame
+    size_t memory_usage() const
+    {
+        std::shared_ptr<const frame_t> frame = latest_frame();
+        return sizeof(session_t) + state_memory_ + history_.memory_usage() + stats_memory_usage() + (frame ? frame->representations.memory_usage() : 0);
+    }
+
+    // Record a request for the session; sessions nobody asks for become idle
+    void touch()
+    {
+        last_access_ = std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    // Whether the session is in use without being asked for: viewers are connected or its loop is running
+    bool active() const
+    {
+        if (num_subscribers() != 0)
+        {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(loop_mutex_);
+        return loop_ && loop_->running();
+    }
+
+    // Time since the last request. Active sessions are never idle.
+    std::chrono::steady_clock::duration idle_time() const
+    {
+        if (active())
+        {
+            return std::chrono::steady_clock::duration::zero();
+        }
+        return std::chrono::steady_clock::now().time_since_epoch() - std::chrono::steady_clock::duration(last_access_.load());
+    }
+
+    // Server-owned clock of this session, which steps it and publishes each frame independently of any client.
+    // Created paused the first time it is asked for, so sessions that are only stepped by hand have no thread.
+    simulation_loop_t &loop()
+    {
+        std::lock_guard<std::mutex> lock(loop_mutex_);
+        if (!loop_)
+        {
+            loop_.reset(new simulation_loop_t([this]()
+                                              {
+                std::lock_guard<std::mutex> lock(mutex);
+                step();
+                publish_frame(); }));
+        }
+        return *loop_;
+    }
+
+private:
+    // Drop what belongs to the world being replaced, and end its recording
+    void release_frame_buffers()
+    {
+        published_grid_.clear();
+        frame_writer_.release();
+        recorder_.close();
+        previous_step_grid_.clear();
+        std::vector<cell_change_t>().swap(step_changes_);
+        std::vector<cell_change_t>().swap(unpublished_changes_);
+        std::vector<cell_change_t>().swap(merge_scratch_);
+        std::string().swap(step_payload_);
+        unpublished_changes_valid_ = false;
+    }
+
+    // Whether each step is diffed against the previous one, which the recording and the history need
+    bool tracking_steps() const
+    {
+        return recorder_.recording() || history_.enabled();
+    }
+
+    size_t stats_memory_usage() const
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        return series_.memory_usage();
+    }
+
+    void publish_stats()
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (stats_generation_ != generation_)
+        {
+            series_.clear();
+        }
+        series_.append(simulation_.step_count(), simulation_.stats());
+        stats_ = simulation_.stats();
+        stats_step_ = simulation_.step_count();
+        stats_generation_ = generation_;
+    }
+
+    // Start the history of a new world from its first step, if the history is on and can hold it
+    void track_steps()
+    {
+        history_.reset(simulation_.grid(), simulation_.step_count(), generation_);
+        if (history_.enabled())
+        {
+            previous_step_grid_ = simulation_.grid();
+        }
+    }
+
+    // Text of a cell in the JSON frame, {"age":0,"energy":0,"type":" "} being 33 bytes
+    static const size_t ESTIMATED_JSON_BYTES_PER_CELL = 40;
+
+    std::string id_;
+    simulation_t simulation_;
+    std::vector<worker_stats_t> worker_stats_;
+    step_executor_t executor_;
+
+    // Current generation and the grid of the latest frame, which the next frame is diffed against when the
+    // steps are not tracked. Guarded by mutex.
+    std::atomic<uint64_t> *generations_;
+    uint64_t generation_ = 0;
+    grid_t<entity_t> published_grid_;
+    frame_writer_t frame_writer_;
+    run_recorder_t recorder_;
+    std::string run_name_;
+    // The grid after the previous step, kept while recording or keeping a history, and the cells changed since
+    grid_t<entity_t> previous_step_grid_;
+    std::vector<cell_change_t> step_changes_;
+    std::string step_payload_;
+    // The changes of the tracked steps since the latest frame, valid only if every one of them was tracked
+    std::vector<cell_change_t> unpublished_changes_;
+    std::vector<cell_change_t> merge_scratch_;
+    bool unpublished_changes_valid_ = false;
+    frame_history_t history_;
+
+    population_stats_t stats_;
+    uint64_t stats_step_ = 0;
+    uint64_t stats_generation_ = 0;
+    population_series_t series_;
+    mutable std::mutex stats_mutex_;
+
+    std::shared_ptr<const frame_t> latest_frame_;
+    delta_history_t delta_history_;
+    mutable std::mutex latest_frame_mutex_;
+
+    std::set<crow::websocket::connection *> subscribers_;
+    mutable std::mutex subscribers_mutex_;
+
+    // Written when a frame is published, read by the registry without taking the session mutex
+    std::atomic<size_t> state_memory_{0};
+    std::atomic<std::chrono::steady_clock::rep> last_access_{0};
+
+    mutable std::mutex loop_mutex_;
+    // Last, so its thread is stopped before anything it ticks is destroyed
+    std::unique_ptr<simulation_loop_t> loop_;
+};
+
+// Every session of the server, keyed by ID.
+// The registry keeps the sessions within a memory budget: before a world starts, inactive sessions, those without
+// viewers or a running loop, are dropped, least recently used first, until it fits. Inactive sessions nobody has
+// asked for within the idle timeout are dropped as well. A dropped session stops its loop and disconnects its viewers; its memory goes once the last
+// request using it returns.
+class session_registry_t
+{
+public:
+    // A budget of 0 bytes is unlimited and an idle timeout of 0 never expires
+    session_registry_t(thread_pool_t *pool, const session_settings_t &settings, size_t memory_budget, std::chrono::seconds idle_timeout)
+        : pool_(pool), settings_(settings), memory_budget_(memory_budget), idle_timeout_(idle_timeout), ids_(std::random_device()()) {}
+
+    // New empty session under a fresh random ID, which becomes the most recent one
+    std::shared_ptr<session_t> create()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string id;
+        do
+        {
+            char digits[17];
+            std::snprintf(digits, sizeof(digits), "%016llx", (unsigned long long)ids_());
+            id = digits;
+        } while (sessions_.count(id) != 0);
+        auto session = std::make_shared<session_t>(id, pool_, settings_, &generations_);
+        sessions_.emplace(id, session);
+        latest_id_ = id;
+        return session;
+    }
+
+    // Session with the given ID, or the most recently created one if the ID is empty. nullptr if there is none.
+    // Finding a session counts as using it.
+    std::shared_ptr<session_t> find(const std::string &id) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = sessions_.find(id.empty() ? latest_id_ : id);
+        if (found == sessions_.end())
+        {
+            return nullptr;
+        }
+        found->second->touch();
+        return found->second;
+    }
+
+    // Returns false if there is no such session
+    bool remove(const std::string &id)
+    {
+        std::shared_ptr<session_t> removed;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = sessions_.find(id);
+            if (found == sessions_.end())
+            {
+                return false;
+            }
+            removed = erase(found);
+        }
+        removed->close();
+        return true;
+    }
+
+    // Drop inactive sessions, least recently used first, until bytes more fit in the budget next to the
+    // sessions left. keep is never dropped and its own usage is not counted, since it is about to be restarted.
+    // Returns false if the bytes cannot fit, in which case nothing is dropped.
+    bool make_room(size_t bytes, const session_t *keep)
+    {
+        if (memory_budget_ == 0)
+        {
+            return true;
+        }
+        std::vector<std::shared_ptr<session_t>> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t used = 0;
+            size_t reclaimable = 0;
+            std::vector<std::pair<std::chrono::steady_clock::duration, std::string>> candidates;
+            for (const auto &entry : sessions_)
+            {
+                if (entry.second.get() == keep)
+                {
+                    continue;
+                }
+                size_t session_memory = entry.second->memory_usage();
+                used += session_memory;
+                if (!entry.second->active())
+                {
+                    reclaimable += session_memory;
+                    candidates.emplace_back(entry.second->idle_time(), entry.first);
+                }
+            }
+            if (bytes > memory_budget_ || used - reclaimable + bytes > memory_budget_)
+            {
+                return false;
+            }
+            // Longest idle first
+            std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<std::chrono::steady_clock::duration, std::string>>());
+            for (size_t k = 0; k < candidates.size() && used + bytes > memory_budget_; k++)
+            {
+                auto found = sessions_.find(candidates[k].second);
+                used -= std::min(used, found->second->memory_usage());
+                dropped.push_back(erase(found));
+            }
+        }
+        for (const auto &session : dropped)
+        {
+            session->close();
+        }
+        return true;
+    }
+
+    // Drop every session idle for longer than the idle timeout
+    void drop_idle()
+    {
+        if (idle_timeout_.count() == 0)
+        {
+            return;
+        }
+        std::vector<std::shared_ptr<session_t>> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = sessions_.begin(); it != sessions_.end();)
+            {
+                auto next = std::next(it);
+                if (it->second->idle_time() > idle_timeout_)
+                {
+                    dropped.push_back(erase(it));
+                }
+                it = next;
+            }
+        }
+        for (const auto &session : dropped)
+        {
+            session->close();
+        }
+    }
+
+    std::vector<std::shared_ptr<session_t>> list() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::shared_ptr<session_t>> sessions;
+        for (const auto &entry : sessions_)
+        {
+            sessions.push_back(entry.second);
+        }
+        return sessions;
+    }
+
+    size_t memory_usage() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t bytes = 0;
+        for (const auto &entry : sessions_)
+        {
+            bytes += entry.second->memory_usage();
+        }
+        return bytes;
+    }
+
+    size_t memory_budget() const { return memory_budget_; }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return sessions_.size();
+    }
+
+private:
+    // Called with mutex_ held; the caller closes the session once it has let go of the lock
+    std::shared_ptr<session_t> erase(std::map<std::string, std::shared_ptr<session_t>>::iterator it)
+    {
+        std::shared_ptr<session_t> session = std::move(it->second);
+        if (latest_id_ == it->first)
+        {
+            latest_id_.clear();
+        }
+        sessions_.erase(it);
+        return session;
+    }
+
+    thread_pool_t *pool_;
+    session_settings_t settings_;
+    size_t memory_budget_;
+    std::chrono::seconds idle_timeout_;
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<session_t>> sessions_;
+    std::string latest_id_;
+    std::mt19937_64 ids_;
+    // Shared by all sessions, so a generation names one world across the server and ETags and cached
+    // URLs of different sessions never collide
+    std::atomic<uint64_t> generations_{0};
+};
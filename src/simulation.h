@@ -0,0 +1,269 @@
+#pragma once
+
+#include "json.hpp"
+#include "claim_bitmap.h"
+#include "counter_rng.h"
+#include "entity.h"
+#include "frame_delta.h"
+#include "grid.h"
+#include "population_stats.h"
+#include "step_engine.h"
+#include "tile_scheduler.h"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Grid dimensions used when the request body does not specify them
+const uint32_t DEFAULT_NUM_ROWS = 15;
+const uint32_t DEFAULT_NUM_COLS = 15;
+const uint32_t MAXIMUM_GRID_SIDE = 10000;
+// Side of the square tiles handed to the workers
+const uint32_t DEFAULT_TILE_SIZE = 32;
+
+// How a step advances the world
+enum step_mode_t
+{
+    in_place_step,       // plants update the grid directly, claimed cells marked in the claim bitmap
+    double_buffered_step // entities read the grid and write the next grid, then the two are swapped
+};
+
+// Everything that determines a run: two simulations started with the same parameters produce
+// bit-identical frames, whatever the number of worker threads or the scheduling policy
+struct simulation_params_t
+{
+    uint32_t height = DEFAULT_NUM_ROWS;
+    uint32_t width = DEFAULT_NUM_COLS;
+    uint64_t plants = 0;
+    uint64_t herbivores = 0;
+    uint64_t carnivores = 0;
+    uint64_t seed = 0;
+    step_mode_t mode = double_buffered_step;
+    uint32_t tile_size = DEFAULT_TILE_SIZE;
+};
+
+// Read the unsigned integer field key of body into value, or default_value if body has no such field.
+// Returns false if the field holds anything else, such as a string, a negative or a fractional number.
+// Callers check the range before narrowing value, so out-of-range numbers are refused rather than truncated.
+inline bool read_unsigned(const nlohmann::json &body, const char *key, uint64_t default_value, uint64_t &value)
+{
+    auto field = body.find(key);
+    if (field == body.end())
+    {
+        value = default_value;
+        return true;
+    }
+    if (!field->is_number_unsigned())
+    {
+        return false;
+    }
+    value = field->get<uint64_t>();
+    return true;
+}
+
+// Read the body of POST /start-simulation. Returns an error message, or an empty string if the body is valid,
+// which includes every field having the expected type and fitting its range.
+// The seed is drawn from std::random_device when the body does not provide one.
+inline std::string parse_simulation_params(const nlohmann::json &body, uint32_t default_tile_size,
+                                           simulation_params_t &params)
+{
+    if (!body.is_object())
+    {
+        return "Invalid request body";
+    }
+    uint64_t height;
+    uint64_t width;
+    uint64_t tile_size;
+    if (!read_unsigned(body, "height", DEFAULT_NUM_ROWS, height) || !read_unsigned(body, "width", DEFAULT_NUM_COLS, width) ||
+        !read_unsigned(body, "plants", 0, params.plants) || !read_unsigned(body, "herbivores", 0, params.herbivores) ||
+        !read_unsigned(body, "carnivores", 0, params.carnivores) || !read_unsigned(body, "tile_size", default_tile_size, tile_size) ||
+        !read_unsigned(body, "seed", 0, params.seed) ||
+        (body.contains("mode") && !body["mode"].is_string()))
+    {
+        return "Invalid request body";
+    }
+
+    if (height == 0 || width == 0 || height > MAXIMUM_GRID_SIDE || width > MAXIMUM_GRID_SIDE)
+    {
+        return "Invalid grid dimensions";
+    }
+    params.height = (uint32_t)height;
+    params.width = (uint32_t)width;
+
+    std::string mode = body.value("mode", "double_buffer");
+    if (mode != "double_buffer" && mode != "in_place")
+    {
+        return "Unknown step mode";
+    }
+    params.mode = mode == "in_place" ? in_place_step : double_buffered_step;
+
+    // Each count is checked on its own first, so the sum cannot overflow
+    const uint64_t num_cells = height * width;
+    if (params.plants > num_cells || params.herbivores > num_cells || params.carnivores > num_cells ||
+        params.plants + params.herbivores + params.carnivores > num_cells)
+    {
+        return "Too many entities";
+    }
+
+    if (tile_size < tile_schedule_t::MINIMUM_TILE_SIZE || tile_size > UINT32_MAX)
+    {
+        return "Invalid tile size";
+    }
+    params.tile_size = (uint32_t)tile_size;
+
+    if (!body.contains("seed"))
+    {
+        std::random_device rd;
+        params.seed = ((uint64_t)rd() << 32) | rd();
+    }
+    return "";
+}
+
+// One world: its grid, the scratch state of the step engines and the step counter.
+//
+// Steps are deterministic. Every random draw comes from cell_rng_t keyed by (seed, step, cell), and
+// conflicts over a cell go to whoever claims it first in a fixed priority order: species (carnivores,
+// then herbivores, then plants), then checkerboard colour, then row-major order inside the tile.
+// Tiles of one colour never share a neighbourhood, so running them concurrently cannot change the outcome.
+class simulation_t
+{
+public:
+    void start(const simulation_params_t &params)
+    {
+        params_ = params;
+        step_ = 0;
+        grid_.assign(params.height, params.width, {empty, 0, 0});
+        next_grid_.assign(params.height, params.width, {empty, 0, 0});
+        claimed_.resize(grid_.size());
+        schedule_.build(params.height, params.width, params.tile_size);
+
+        // Entity number n draws its cell from the placement stream, so placement is reproducible too
+        uint64_t placed = 0;
+        auto place_entities = [&](entity_type_t type, uint64_t count, int32_t energy)
+        {
+            for (uint64_t k = 0; k < count; k++)
+            {
+                cell_rng_t rng(params.seed, PLACEMENT_STREAM, placed++);
+                uint32_t row = rng.below(params.height);
+                uint32_t col = rng.below(params.width);
+                while (grid_(row, col).type != empty)
+                {
+                    row = rng.below(params.height);
+                    col = rng.below(params.width);
+                }
+                grid_(row, col) = {type, energy, 0};
+            }
+        };
+        place_entities(plant, params.plants, 0);
+        place_entities(herbivore, params.herbivores, INITIAL_ENERGY);
+        place_entities(carnivore, params.carnivores, INITIAL_ENERGY);
+        stats_ = measure_population(grid_);
+    }
+
+    // Resume a run from a checkpoint: grid is the world after step steps of a run started with params.
+    // Draws are keyed by (seed, step, cell), so the seed and the step counter are the whole RNG state.
+    void restore(const simulation_params_t &params, uint64_t step, grid_t<entity_t> &&grid)
+    {
+        params_ = params;
+        step_ = step;
+        grid_ = std::move(grid);
+        // The double-buffered step sizes its scratch grid on first use
+        next_grid_.clear();
+        claimed_.resize(grid_.size());
+        schedule_.build(params.height, params.width, params.tile_size);
+        stats_ = measure_population(grid_);
+    }
+
+    void step(const step_executor_t &executor)
+    {
+        if (params_.mode == double_buffered_step)
+        {
+            // The workers' statistics add up to those of the new grid
+            step_double_buffered(grid_, next_grid_, claimed_, schedule_, executor, params_.seed, step_, step_stats_);
+            stats_ = population_stats_t();
+        }
+        else
+        {
+            // The workers' statistics add up to the change
+            step_in_place(grid_, claimed_, schedule_, executor, params_.seed, step_, step_stats_);
+        }
+        for (const population_stats_t &stats : step_stats_)
+        {
+            stats_.merge(stats);
+        }
+        step_++;
+    }
+
+    const grid_t<entity_t> &grid() const { return grid_; }
+    const simulation_params_t &params() const { return params_; }
+    // Number of steps simulated since start
+    uint64_t step_count() const { return step_; }
+    // Statistics of the grid, kept up to date by the steps as they change cells
+    const population_stats_t &stats() const { return stats_; }
+
+    // Bytes held by the grids and the step scratch
+    size_t memory_usage() const
+    {
+        return grid_.memory_usage() + next_grid_.memory_usage() + claimed_.memory_usage() + schedule_.memory_usage() +
+               step_stats_.capacity() * sizeof(population_stats_t);
+    }
+
+private:
+    simulation_params_t params_;
+    grid_t<entity_t> grid_;
+    // Scratch grid written by the double-buffered step
+    grid_t<entity_t> next_grid_;
+    // Cells already updated during the current step, shared by both step modes
+    claim_bitmap_t claimed_;
+    // Checkerboard tiling of the grid used to run both step modes in parallel
+    tile_schedule_t schedule_;
+    uint64_t step_ = 0;
+    population_stats_t stats_;
+    // Statistics gathered by each worker during the last step
+    std::vector<population_stats_t> step_stats_;
+};
+
+// Auxiliary code to convert the entity_type_t enum to a string
+NLOHMANN_JSON_SERIALIZE_ENUM(entity_type_t, {
+                                                {empty, " "},
+                                                {plant, "P"},
+                                                {herbivore, "H"},
+                                                {carnivore, "C"},
+                                            })
+
+// Auxiliary code to convert the entity_t struct to a JSON object
+namespace nlohmann
+{
+    inline void to_json(nlohmann::json &j, const entity_t &e)
+    {
+        j = nlohmann::json{{"type", e.type}, {"energy", e.energy}, {"age", e.age}};
+    }
+
+    // The grid is sent as an array of rows, the same shape the page has always consumed
+    inline void to_json(nlohmann::json &j, const grid_t<entity_t> &grid)
+    {
+        j = nlohmann::json::array();
+        for (uint32_t i = 0; i < grid.height(); i++)
+        {
+            nlohmann::json row = nlohmann::json::array();
+            for (uint32_t c = 0; c < grid.width(); c++)
+            {
+                row.push_back(grid(i, c));
+            }
+            j.push_back(std::move(row));
+        }
+    }
+
+    // A changed cell is sent as [index, type, age, energy]
+    inline void to_json(nlohmann::json &j, const cell_change_t &c)
+    {
+        j = nlohmann::json::array({c.index, c.cell.type, c.cell.age, c.cell.energy});
+    }
+
+    inline void to_json(nlohmann::json &j, const population_t &p)
+    {
+        j = nlohmann::json{{"plants", p.plants}, {"herbivores", p.herbivores}, {"carnivores", p.carnivores}};
+    }
+}
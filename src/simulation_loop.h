@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Server-owned clock that advances the simulation on its own thread.
+// Every tick calls the given function; ticks happen at a fixed rate, or back to back when the rate is 0.
+class simulation_loop_t
+{
+public:
+    explicit simulation_loop_t(std::function<void()> tick) : tick_(std::move(tick))
+    {
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~simulation_loop_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    simulation_loop_t(const simulation_loop_t &) = delete;
+    simulation_loop_t &operator=(const simulation_loop_t &) = delete;
+
+    // Slowest rate other than 0, one tick every 1000 seconds; slower rates are raised to it
+    static constexpr double MINIMUM_TICK_RATE = 0.001;
+
+    void pause() { set_running(false); }
+    void resume() { set_running(true); }
+
+    // Ticks per second; 0 runs as fast as possible
+    void set_tick_rate(double ticks_per_second)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ticks_per_second_ = ticks_per_second > 0 ? std::max(ticks_per_second, MINIMUM_TICK_RATE) : 0;
+        }
+        cv_.notify_all();
+    }
+
+    bool running() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return running_;
+    }
+
+    double tick_rate() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return ticks_per_second_;
+    }
+
+private:
+    void set_running(bool running)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = running;
+        }
+        cv_.notify_all();
+    }
+
+    void run()
+    {
+        using clock = std::chrono::steady_clock;
+        clock::time_point next_tick = clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            cv_.wait(lock, [this]() { return stopping_ || running_; });
+            if (stopping_)
+            {
+                return;
+            }
+            if (ticks_per_second_ > 0)
+            {
+                // Wake up early if paused, stopped or given a new rate
+                double rate = ticks_per_second_;
+                if (cv_.wait_until(lock, next_tick, [&]() { return stopping_ || !running_ || ticks_per_second_ != rate; }))
+                {
+                    next_tick = clock::now();
+                    continue;
+                }
+                auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / rate));
+                next_tick = std::max(next_tick + period, clock::now());
+            }
+            lock.unlock();
+            tick_();
+            lock.lock();
+        }
+    }
+
+    std::function<void()> tick_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = false;
+    bool stopping_ = false;
+    double ticks_per_second_ = 1;
+    std::thread thread_;
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "claim_bitmap.h"
+#include "counter_rng.h"
+#include "entity.h"
+#include "grid.h"
+#include "population_stats.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <vector>
+
+// Double-buffered step engine.
+//
+// Every entity reads its neighbourhood from the current grid and writes its outcome into the next
+// grid, which starts the step empty; the two grids are swapped at the end of the step.
+// Cells something moves into, is born in or is eaten at are claimed in a bitmap:
+//  - a cell that is empty in the current grid is free as long as it has not been claimed;
+//  - species act in the order carnivores, herbivores, plants, so predators always act before their prey.
+//    A prey whose own cell has been claimed was eaten and does nothing.
+// Each species runs as four checkerboard phases of tiles (see tile_schedule_t), so workers never
+// touch the same neighbourhood at the same time and no per-cell locking is needed.
+// Every cell written to the next grid is also added to the population statistics of the worker writing it,
+// so that the statistics of the whole next grid are the sum over the workers, without reading it again.
+
+// Up to four von Neumann neighbours of a cell
+struct neighbour_list_t
+{
+    pos_t cells[4];
+    uint32_t count = 0;
+
+    bool empty() const { return count == 0; }
+    void push_back(pos_t pos) { cells[count++] = pos; }
+};
+
+inline pos_t pick_random_cell(const neighbour_list_t &positions, cell_rng_t &rng)
+{
+    return positions.cells[rng.below(positions.count)];
+}
+
+// Neighbours of pos whose type in the current grid is `type` and that nobody has claimed yet
+inline neighbour_list_t unclaimed_neighbours(const grid_t<entity_t> &current, const claim_bitmap_t &claimed,
+                                             pos_t pos, entity_type_t type)
+{
+    neighbour_list_t result;
+    const int64_t i = pos.i;
+    const int64_t j = pos.j;
+    const int64_t neighbours[4][2] = {{i + 1, j}, {i, j + 1}, {i - 1, j}, {i, j - 1}};
+    for (auto &n : neighbours)
+    {
+        if (!current.contains(n[0], n[1]))
+        {
+            continue;
+        }
+        size_t idx = current.index(n[0], n[1]);
+        if (current[idx].type == type && !claimed.test(idx))
+        {
+            result.push_back({(uint32_t)n[0], (uint32_t)n[1]});
+        }
+    }
+    return result;
+}
+
+// Behaviour shared by herbivores and carnivores, which differ only in their parameters
+struct animal_rules_t
+{
+    entity_type_t type;
+    entity_type_t prey;
+    int32_t maximum_age;
+    double reproduction_probability;
+    double eat_probability;
+    double move_probability;
+    int32_t energy_gain;
+};
+
+const animal_rules_t HERBIVORE_RULES = {herbivore, plant, HERBIVORE_MAXIMUM_AGE, HERBIVORE_REPRODUCTION_PROBABILITY,
+                                        HERBIVORE_EAT_PROBABILITY, HERBIVORE_MOVE_PROBABILITY, HERBIVORE_ENERGY_GAIN};
+const animal_rules_t CARNIVORE_RULES = {carnivore, herbivore, CARNIVORE_MAXIMUM_AGE, CARNIVORE_REPRODUCTION_PROBABILITY,
+                                        CARNIVORE_EAT_PROBABILITY, CARNIVORE_MOVE_PROBABILITY, CARNIVORE_ENERGY_GAIN};
+
+// Pick one of the candidates and claim it, failing if another worker got there first
+inline bool claim_random_cell(const grid_t<entity_t> &current, claim_bitmap_t &claimed,
+                              const neighbour_list_t &candidates, cell_rng_t &rng, pos_t &chose_position)
+{
+    if (candidates.empty())
+    {
+        return false;
+    }
+    chose_position = pick_random_cell(candidates, rng);
+    return !claimed.test_and_set(current.index(chose_position.i, chose_position.j));
+}
+
+inline void step_plant(const grid_t<entity_t> &current, grid_t<entity_t> &next, claim_bitmap_t &claimed, pos_t pos,
+                       cell_rng_t &rng, population_stats_t &stats)
+{
+    entity_t self = current(pos.i, pos.j);
+    if (self.age >= (int32_t)PLANT_MAXIMUM_AGE)
+    {
+        return;
+    }
+    if (rng.chance(PLANT_REPRODUCTION_PROBABILITY))
+    {
+        pos_t chose_position;
+        if (claim_random_cell(current, claimed, unclaimed_neighbours(current, claimed, pos, empty), rng, chose_position))
+        {
+            next(chose_position.i, chose_position.j) = {plant, 0, 0};
+            stats.add({plant, 0, 0});
+        }
+    }
+    self.age++;
+    next(pos.i, pos.j) = self;
+    stats.add(self);
+}
+
+inline void step_animal(const grid_t<entity_t> &current, grid_t<entity_t> &next, claim_bitmap_t &claimed, pos_t pos,
+                        const animal_rules_t &rules, cell_rng_t &rng, population_stats_t &stats)
+{
+    entity_t self = current(pos.i, pos.j);
+    pos_t chose_position;
+    if (self.age >= rules.maximum_age || self.energy <= 0)
+    {
+        return;
+    }
+    self.age++;
+    if (rng.chance(rules.reproduction_probability) && self.energy > (int32_t)THRESHOLD_ENERGY_FOR_REPRODUCTION)
+    {
+        if (claim_random_cell(current, claimed, unclaimed_neighbours(current, claimed, pos, empty), rng, chose_position))
+        {
+            next(chose_position.i, chose_position.j) = {rules.type, INITIAL_ENERGY, 0};
+            stats.add({rules.type, INITIAL_ENERGY, 0});
+            self.energy -= REPRODUCTION_ENERGY_COST;
+            next(pos.i, pos.j) = self;
+            stats.add(self);
+            return;
+        }
+    }
+    if (rng.chance(rules.eat_probability))
+    {
+        if (claim_random_cell(current, claimed, unclaimed_neighbours(current, claimed, pos, rules.prey), rng, chose_position))
+        {
+            self.energy = std::min<int32_t>(self.energy + rules.energy_gain, MAXIMUM_ENERGY);
+            next(chose_position.i, chose_position.j) = self;
+            stats.add(self);
+            return;
+        }
+    }
+    if (rng.chance(rules.move_probability))
+    {
+        if (claim_random_cell(current, claimed, unclaimed_neighbours(current, claimed, pos, empty), rng, chose_position))
+        {
+            self.energy -= MOVE_ENERGY_COST;
+            next(chose_position.i, chose_position.j) = self;
+            stats.add(self);
+            return;
+        }
+    }
+    next(pos.i, pos.j) = self;
+    stats.add(self);
+}
+
+// Run every entity of one species inside a tile, skipping those that were eaten earlier in the step
+inline void step_species(const grid_t<entity_t> &current, grid_t<entity_t> &next, claim_bitmap_t &claimed,
+                         entity_type_t type, const tile_t &tile, uint64_t seed, uint64_t step, population_stats_t &stats)
+{
+    for (uint32_t i = tile.row_begin; i < tile.row_end; i++)
+    {
+        for (uint32_t j = tile.col_begin; j < tile.col_end; j++)
+        {
+            size_t idx = current.index(i, j);
+            if (current[idx].type != type || claimed.test(idx))
+            {
+                continue;
+            }
+            cell_rng_t rng(seed, step, idx);
+            if (type == plant)
+            {
+                step_plant(current, next, claimed, {i, j}, rng, stats);
+            }
+            else
+            {
+                step_animal(current, next, claimed, {i, j}, type == herbivore ? HERBIVORE_RULES : CARNIVORE_RULES, rng, stats);
+            }
+        }
+    }
+}
+
+// Advance current by one step using next as scratch space, then swap the two grids.
+// Random draws are keyed by (seed, step, cell), see cell_rng_t.
+// stats gets one entry per participant, which together add up to the statistics of the new grid.
+inline void step_double_buffered(grid_t<entity_t> &current, grid_t<entity_t> &next, claim_bitmap_t &claimed,
+                                 const tile_schedule_t &schedule, const step_executor_t &executor,
+                                 uint64_t seed, uint64_t step, std::vector<population_stats_t> &stats)
+{
+    stats.assign(num_participants(executor), population_stats_t());
+    const entity_t empty_cell = {empty, 0, 0};
+    if (next.height() != current.height() || next.width() != current.width())
+    {
+        next.assign(current.height(), current.width(), empty_cell);
+    }
+    else if (executor.pool != nullptr)
+    {
+        executor.pool->parallel_for(next.height(), 64, [&](size_t begin, size_t end)
+                           { std::fill(next.row(begin), next.row(begin) + (end - begin) * next.width(), empty_cell); });
+    }
+    else
+    {
+        next.fill(empty_cell);
+    }
+    if (claimed.size() != current.size())
+    {
+        claimed.resize(current.size());
+    }
+    else
+    {
+        claimed.clear();
+    }
+    for (entity_type_t type : {carnivore, herbivore, plant})
+    {
+        run_coloured_phases(schedule, executor, [&](const tile_t &tile, size_t participant)
+                            { step_species(current, next, claimed, type, tile, seed, step, stats[participant]); });
+    }
+    current.swap(next);
+}
+
+// In-place step, the original engine: only plants act, and they update the grid directly.
+// Cells a plant spreads to are claimed, so a newborn plant does not act until the next step.
+// Each change is recorded in stats as it is made.
+inline void simulate_plant(grid_t<entity_t> &grid, claim_bitmap_t &claimed, pos_t pos, cell_rng_t &rng,
+                           population_stats_t &stats)
+{
+    entity_t &current = grid(pos.i, pos.j);
+    const entity_t before = current;
+    if (current.age == (int32_t)PLANT_MAXIMUM_AGE)
+    {
+        current.type = empty;
+        current.age = 0;
+        stats.remove(before);
+        return;
+    }
+    if (rng.chance(PLANT_REPRODUCTION_PROBABILITY))
+    {
+        pos_t chose_position;
+        if (claim_random_cell(grid, claimed, unclaimed_neighbours(grid, claimed, pos, empty), rng, chose_position))
+        {
+            entity_t &spread = grid(chose_position.i, chose_position.j);
+            const entity_t spread_before = spread;
+            spread.type = plant;
+            spread.age = 0;
+            stats.replace(spread_before, spread);
+        }
+    }
+    current.age++;
+    stats.replace(before, current);
+}
+
+// stats gets one entry per participant, which together add up to the change the step makes to the statistics.
+inline void step_in_place(grid_t<entity_t> &grid, claim_bitmap_t &claimed, const tile_schedule_t &schedule,
+                          const step_executor_t &executor, uint64_t seed, uint64_t step, std::vector<population_stats_t> &stats)
+{
+    stats.assign(num_participants(executor), population_stats_t());
+    if (claimed.size() != grid.size())
+    {
+        claimed.resize(grid.size());
+    }
+    else
+    {
+        claimed.clear();
+    }
+    run_coloured_phases(schedule, executor, [&](const tile_t &tile, size_t participant)
+                        {
+        for (uint32_t i = tile.row_begin; i < tile.row_end; i++)
+        {
+            for (uint32_t j = tile.col_begin; j < tile.col_end; j++)
+            {
+                size_t idx = grid.index(i, j);
+                if (grid[idx].type == plant && !claimed.test(idx))
+                {
+                    cell_rng_t rng(seed, step, idx);
+                    simulate_plant(grid, claimed, {i, j}, rng, stats[participant]);
+                }
+            }
+        } });
+}
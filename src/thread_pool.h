@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// How run_tasks spreads its tasks over the workers
+enum scheduling_policy_t
+{
+    static_split, // each worker runs one contiguous slice of the tasks and nothing else
+    work_stealing // workers start on their own slice and steal from busy peers once it runs out
+};
+
+// Time one worker spent running tasks and waiting, accumulated over one or more run_tasks calls
+struct worker_stats_t
+{
+    uint64_t busy_ns = 0;
+    uint64_t idle_ns = 0;
+    uint64_t tasks = 0;
+    uint64_t stolen = 0;
+};
+
+// Fixed set of long-lived worker threads fed from a shared job queue.
+// The pool is created once when the server starts and reused by every step.
+class thread_pool_t
+{
+public:
+    explicit thread_pool_t(size_t num_threads)
+    {
+        if (num_threads == 0)
+        {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (size_t k = 0; k < num_threads; k++)
+        {
+            workers_.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~thread_pool_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto &worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    thread_pool_t(const thread_pool_t &) = delete;
+    thread_pool_t &operator=(const thread_pool_t &) = delete;
+
+    size_t size() const { return workers_.size(); }
+
+    // Queue a job to run on one of the workers
+    void submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+
+    // Run task(begin, end) over [0, count) in batches of batch_size and wait until every batch is done.
+    // The calling thread works on batches too, so this is safe to call from inside a job.
+    void parallel_for(size_t count, size_t batch_size, const std::function<void(size_t, size_t)> &task)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        batch_size = std::max<size_t>(1, batch_size);
+        const size_t num_batches = (count + batch_size - 1) / batch_size;
+
+        struct shared_state_t
+        {
+            std::atomic<size_t> next_batch{0};
+            size_t pending_helpers = 0;
+            std::mutex mutex;
+            std::condition_variable done;
+        } state;
+
+        auto run_batches = [&]()
+        {
+            for (size_t b = state.next_batch++; b < num_batches; b = state.next_batch++)
+            {
+                size_t begin = b * batch_size;
+                task(begin, std::min(count, begin + batch_size));
+            }
+        };
+
+        const size_t helpers = std::min(workers_.size(), num_batches - 1);
+        state.pending_helpers = helpers;
+        for (size_t k = 0; k < helpers; k++)
+        {
+            submit([&]()
+                   {
+                run_batches();
+                std::lock_guard<std::mutex> lock(state.mutex);
+                if (--state.pending_helpers == 0)
+                {
+                    state.done.notify_one();
+                } });
+        }
+        run_batches();
+
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.done.wait(lock, [&]() { return state.pending_helpers == 0; });
+    }
+
+    // Run task(k, p) for every k in [0, count) with exactly one participant p per worker and wait for all of them.
+    // Participant p starts on the p-th contiguous slice of tasks; with work_stealing it then takes tasks from
+    // the back of other participants' slices. If stats is given, stats[p] accumulates participant p's busy
+    // time (inside task) and idle time (the rest of the call). Must not be called from inside a job.
+    void run_tasks(size_t count, scheduling_policy_t policy, const std::function<void(size_t, size_t)> &task,
+                   std::vector<worker_stats_t> *stats = nullptr)
+    {
+        const size_t participants = workers_.size();
+        if (stats != nullptr && stats->size() != participants)
+        {
+            stats->assign(participants, worker_stats_t());
+        }
+        if (count == 0)
+        {
+            return;
+        }
+
+        struct task_deque_t
+        {
+            std::mutex mutex;
+            std::deque<size_t> tasks;
+        };
+        std::vector<task_deque_t> deques(participants);
+        const size_t slice = (count + participants - 1) / participants;
+        for (size_t k = 0; k < count; k++)
+        {
+            deques[k / slice].tasks.push_back(k);
+        }
+
+        std::vector<worker_stats_t> local(participants);
+        size_t pending = participants;
+        std::mutex done_mutex;
+        std::condition_variable done;
+        const auto start = std::chrono::steady_clock::now();
+
+        // Owner takes from the front of its slice, thieves from the back of someone else's
+        auto take = [&](size_t owner, size_t &k, bool steal)
+        {
+            std::lock_guard<std::mutex> lock(deques[owner].mutex);
+            std::deque<size_t> &tasks = deques[owner].tasks;
+            if (tasks.empty())
+            {
+                return false;
+            }
+            if (steal)
+            {
+                k = tasks.back();
+                tasks.pop_back();
+            }
+            else
+            {
+                k = tasks.front();
+                tasks.pop_front();
+            }
+            return true;
+        };
+
+        for (size_t p = 0; p < participants; p++)
+        {
+            submit([&, p]()
+                   {
+                worker_stats_t &mine = local[p];
+                auto run = [&](size_t k)
+                {
+                    auto begin = std::chrono::steady_clock::now();
+                    task(k, p);
+                    mine.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+                    mine.tasks++;
+                };
+                size_t k;
+                while (take(p, k, false))
+                {
+                    run(k);
+                }
+                if (policy == work_stealing)
+                {
+                    for (size_t victim = (p + 1) % participants; victim != p; victim = (victim + 1) % participants)
+                    {
+                        while (take(victim, k, true))
+                        {
+                            run(k);
+                            mine.stolen++;
+                        }
+                    }
+                }
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if (--pending == 0)
+                {
+                    done.notify_one();
+                } });
+        }
+
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.wait(lock, [&]() { return pending == 0; });
+        if (stats != nullptr)
+        {
+            const uint64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            for (size_t p = 0; p < participants; p++)
+            {
+                worker_stats_t &total = (*stats)[p];
+                total.busy_ns += local[p].busy_ns;
+                total.idle_ns += wall_ns - std::min(wall_ns, local[p].busy_ns);
+                total.tasks += local[p].tasks;
+                total.stolen += local[p].stolen;
+            }
+        }
+    }
+
+private:
+    void worker_loop()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+                if (stopping_ && jobs_.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
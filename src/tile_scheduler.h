@@ -0,0 +1,96 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Rectangular block of cells [row_begin, row_end) x [col_begin, col_end)
+struct tile_t
+{
+    uint32_t row_begin;
+    uint32_t row_end;
+    uint32_t col_begin;
+    uint32_t col_end;
+};
+
+// Splits a grid into square tiles and colours them like a 2x2 checkerboard.
+// An entity reads and writes at most one cell outside its own tile, so as long as tiles are at least
+// two cells wide, two tiles of the same colour never touch each other's von Neumann neighbourhood
+// and can run at the same time without any locking.
+class tile_schedule_t
+{
+public:
+    static constexpr size_t NUM_COLOURS = 4;
+    static constexpr uint32_t MINIMUM_TILE_SIZE = 2;
+
+    void build(uint32_t height, uint32_t width, uint32_t tile_size)
+    {
+        tile_size = std::max(tile_size, MINIMUM_TILE_SIZE);
+        for (auto &tiles : colours_)
+        {
+            tiles.clear();
+        }
+        for (uint32_t ti = 0, row = 0; row < height; ti++, row += tile_size)
+        {
+            for (uint32_t tj = 0, col = 0; col < width; tj++, col += tile_size)
+            {
+                tile_t tile = {row, std::min(height, row + tile_size), col, std::min(width, col + tile_size)};
+                colours_[(ti % 2) * 2 + tj % 2].push_back(tile);
+            }
+        }
+    }
+
+    const std::vector<tile_t> &colour(size_t c) const { return colours_[c]; }
+
+    size_t memory_usage() const
+    {
+        size_t bytes = 0;
+        for (const auto &tiles : colours_)
+        {
+            bytes += tiles.capacity() * sizeof(tile_t);
+        }
+        return bytes;
+    }
+
+private:
+    std::vector<tile_t> colours_[NUM_COLOURS];
+};
+
+// Where and how the tiles of a step are run
+struct step_executor_t
+{
+    thread_pool_t *pool = nullptr; // nullptr runs every tile on the calling thread
+    scheduling_policy_t policy = work_stealing;
+    std::vector<worker_stats_t> *stats = nullptr; // per-worker timings, accumulated over the step
+};
+
+// Number of participants run_coloured_phases hands tiles to
+inline size_t num_participants(const step_executor_t &executor)
+{
+    return executor.pool == nullptr ? 1 : executor.pool->size();
+}
+
+// Run fn(tile, participant) on every tile, one colour after the other.
+// Tiles of the same colour are spread over the pool according to the executor's policy; participant, below
+// num_participants(executor), identifies the worker running the tile, so fn can keep per-worker state.
+template <typename F>
+void run_coloured_phases(const tile_schedule_t &schedule, const step_executor_t &executor, F fn)
+{
+    for (size_t c = 0; c < tile_schedule_t::NUM_COLOURS; c++)
+    {
+        const std::vector<tile_t> &tiles = schedule.colour(c);
+        if (executor.pool == nullptr)
+        {
+            for (const tile_t &tile : tiles)
+            {
+                fn(tile, 0);
+            }
+            continue;
+        }
+        executor.pool->run_tasks(tiles.size(), executor.policy, [&](size_t k, size_t participant)
+                                 { fn(tiles[k], participant); }, executor.stats);
+    }
+}
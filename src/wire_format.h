@@ -0,0 +1,147 @@
+#pragma once
+
+#include "json.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+// Encodings of request and response bodies. BSON is left out: its top level must be an object,
+// and grids are sent as arrays.
+enum wire_format_t
+{
+    json_format,
+    cbor_format,
+    msgpack_format
+};
+
+inline const char *content_type_of(wire_format_t format)
+{
+    switch (format)
+    {
+    case cbor_format:
+        return "application/cbor";
+    case msgpack_format:
+        return "application/msgpack";
+    default:
+        return "application/json";
+    }
+}
+
+inline const char *format_name(wire_format_t format)
+{
+    switch (format)
+    {
+    case cbor_format:
+        return "cbor";
+    case msgpack_format:
+        return "msgpack";
+    default:
+        return "json";
+    }
+}
+
+// Format named by a media type, ignoring parameters such as charset. Returns false if it is not supported.
+inline bool format_of_media_type(std::string media_type, wire_format_t &format)
+{
+    media_type = media_type.substr(0, media_type.find(';'));
+    media_type.erase(0, media_type.find_first_not_of(" \t"));
+    media_type.erase(media_type.find_last_not_of(" \t") + 1);
+    if (media_type == "application/json" || media_type == "application/*" || media_type == "*/*")
+    {
+        format = json_format;
+    }
+    else if (media_type == "application/cbor")
+    {
+        format = cbor_format;
+    }
+    else if (media_type == "application/msgpack" || media_type == "application/x-msgpack")
+    {
+        format = msgpack_format;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Response format for an Accept header: the supported media type with the highest q value, the first one
+// listed on ties. JSON when the header is missing or names nothing supported.
+inline wire_format_t negotiate_format(const std::string &accept)
+{
+    wire_format_t best = json_format;
+    double best_q = 0;
+    size_t begin = 0;
+    while (begin < accept.size())
+    {
+        size_t end = accept.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = accept.size();
+        }
+        std::string range = accept.substr(begin, end - begin);
+        begin = end + 1;
+
+        double q = 1;
+        size_t q_param = range.find(";q=");
+        if (q_param == std::string::npos)
+        {
+            q_param = range.find("; q=");
+        }
+        if (q_param != std::string::npos)
+        {
+            q = std::strtod(range.c_str() + range.find('=', q_param) + 1, nullptr);
+        }
+        wire_format_t format;
+        if (q > best_q && format_of_media_type(range, format))
+        {
+            best = format;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+// Format of a request body from its Content-Type header. Anything but CBOR and MessagePack is read as JSON,
+// as bodies always were, so clients that send JSON under another type (curl -d says form-urlencoded) keep working.
+inline wire_format_t request_format(const std::string &content_type)
+{
+    wire_format_t format;
+    if (format_of_media_type(content_type, format))
+    {
+        return format;
+    }
+    return json_format;
+}
+
+inline nlohmann::json decode_body(const std::string &body, wire_format_t format)
+{
+    switch (format)
+    {
+    case cbor_format:
+        return nlohmann::json::from_cbor(body);
+    case msgpack_format:
+        return nlohmann::json::from_msgpack(body);
+    default:
+        return nlohmann::json::parse(body);
+    }
+}
+
+inline std::string encode_body(const nlohmann::json &value, wire_format_t format)
+{
+    std::string out;
+    switch (format)
+    {
+    case cbor_format:
+        nlohmann::json::to_cbor(value, out);
+        break;
+    case msgpack_format:
+        nlohmann::json::to_msgpack(value, out);
+        break;
+    default:
+        out = value.dump();
+        break;
+    }
+    return out;
+}